@@ -9,6 +9,7 @@
 var menuContent
 var menuSettings
 var settings
+var live
 
 ////////////////////////////////////////////////////////////////////////////////
 // menu
@@ -88,6 +89,9 @@ function buildMenu()
 
 function menuChange(key, value)
 {
+    if (liveSend(`${key}=${value}`))
+        return
+
     let http = new XMLHttpRequest()
     http.open('GET', `/set?${key}=${value}`, true)
     http.send(null)    
@@ -100,6 +104,51 @@ function cmd(cmd)
     http.send(null)    
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// live view (websocket)
+////////////////////////////////////////////////////////////////////////////////
+
+function liveStart()
+{
+    liveStop()
+
+    const img = document.getElementById('live')
+    const image = document.getElementById('image')
+    const protocol = (location.protocol == 'https:') ? 'wss:' : 'ws:'
+
+    live = new WebSocket(`${protocol}//${location.host}/ws/stream`)
+    live.binaryType = 'blob'
+    live.onmessage = function(event)
+    {
+        const url = URL.createObjectURL(event.data)
+        img.onload = function() { URL.revokeObjectURL(url) }
+        img.src = url
+    }
+    live.onclose = function() { live = null }
+
+    image.style.display = 'none'
+    img.style.display = 'block'
+}
+
+function liveStop()
+{
+    if (live)
+    {
+        live.close()
+        live = null
+    }
+    document.getElementById('live').style.display = 'none'
+    document.getElementById('image').style.display = 'block'
+}
+
+function liveSend(msg)
+{
+    if (!live || (live.readyState != WebSocket.OPEN))
+        return false
+    live.send(msg)
+    return true
+}
+
 //window.onclick = function(event)
 //{
 //    if (!event.target.matches('.dropdown-button'))
@@ -145,9 +194,22 @@ function uploadFirmware(inputFile)
 
     msg.textContent = 'Uploading, please wait...'
 
-    formData.set('esp-pwd', password.value)
-    formData.set('firmware', firmware.files[0])
-    fetch('/ota', { method: 'POST', body: formData })
+    // the device checks the image against firmware-sha256 before booting it,
+    // crypto.subtle is only available on https, compressed and delta images
+    // (tools/ota-image.py) hash differently and are left to the device
+    const digest = window.crypto && crypto.subtle ?
+          firmware.files[0].arrayBuffer().then(buff => new Uint8Array(buff)[0] == 0xe9 ? crypto.subtle.digest('SHA-256', buff) : null) :
+          Promise.resolve(null)
+
+    digest
+        .then(sha =>
+              {
+                  formData.set('esp-pwd', password.value)
+                  if (sha)
+                      formData.set('firmware-sha256', Array.from(new Uint8Array(sha), b => b.toString(16).padStart(2, '0')).join(''))
+                  formData.set('firmware', firmware.files[0])
+                  return fetch('/ota', { method: 'POST', body: formData })
+              })
         .then(response => response.text()) // should check if response is text/plain
         .then(text => 
               {
@@ -160,6 +222,43 @@ function uploadFirmware(inputFile)
               })
 }
 
+function pullFirmware()
+{
+    const msg = document.getElementById('ota-msg')
+    const password = document.getElementById('esp-pwd')
+    let formData = new FormData()
+
+    msg.textContent = 'Checking, please wait...'
+
+    // the device downloads in the background, its status is polled
+    formData.set('esp-pwd', password.value)
+    fetch('/ota-pull', { method: 'POST', body: formData })
+        .then(response => response.text())
+        .then(text =>
+              {
+                  msg.textContent = text
+                  if (!text.includes('started'))
+                      return
+                  const poll = setInterval(() =>
+                      {
+                          fetch('/ota-pull')
+                              .then(response => response.text())
+                              .then(text =>
+                                    {
+                                        msg.textContent = text
+                                        if (text.startsWith('checking'))
+                                            return
+                                        clearInterval(poll)
+                                        if (text.includes('booting'))
+                                        {
+                                            new Promise(resolve => setTimeout(resolve, 6000))
+                                                .then(() => { window.location.href = '/esp32-cam.html' })
+                                        }
+                                    })
+                      }, 2000)
+              })
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Setup (esp32-cam-setup.html)
 ////////////////////////////////////////////////////////////////////////////////
@@ -116,35 +116,156 @@ std::string ip_to_s(uint8_t *ip)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-std::string jsonStr(const std::string &key, const std::string &val)
+JsonWriter::JsonWriter(std::string &out) : _out{&out}
 {
-  return "\"" + key + "\": \"" + val + "\"" ;
 }
 
-std::string jsonInt(const std::string &key, const std::string &val)
+JsonWriter::JsonWriter(httpd_req_t *req) : _req{req}
 {
-  return "\"" + key + "\": " + val ;
+  httpd_resp_set_type(req, "application/json") ;
 }
 
-std::string jsonInt(const std::string &key, int32_t val)
+JsonWriter& JsonWriter::obj(const char *k)
 {
-  return jsonInt(key, to_s(val)) ;
+  key(k) ;
+  raw("{", 1) ;
+  _nested &= ~(1u << ++_level) ;
+  _first = true ;
+  return *this ;
 }
 
-std::string jsonArr(const std::string &key, const std::vector<std::string> &arr)
+JsonWriter& JsonWriter::obj(const char *k, size_t size)
 {
-  std::string json = "\"" + key + "\": [ " ;
-  bool first{true} ;
-  for (const std::string &ele : arr)
+  key(k, size) ;
+  raw("{", 1) ;
+  _nested &= ~(1u << ++_level) ;
+  _first = true ;
+  return *this ;
+}
+
+JsonWriter& JsonWriter::arr(const char *k)
+{
+  key(k) ;
+  raw("[", 1) ;
+  _nested |= 1u << ++_level ;
+  _first = true ;
+  return *this ;
+}
+
+JsonWriter& JsonWriter::end()
+{
+  raw((_nested & (1u << _level--)) ? "]" : "}", 1) ;
+  _first = false ;
+  return *this ;
+}
+
+JsonWriter& JsonWriter::str(const char *k, const char *val)
+{
+  key(k) ;
+  raw("\"", 1) ;
+  escaped(val, strlen(val)) ;
+  raw("\"", 1) ;
+  return *this ;
+}
+
+JsonWriter& JsonWriter::str(const char *k, const std::string &val)
+{
+  key(k) ;
+  raw("\"", 1) ;
+  escaped(val.data(), val.size()) ;
+  raw("\"", 1) ;
+  return *this ;
+}
+
+JsonWriter& JsonWriter::num(const char *k, int32_t val)
+{
+  char buff[12] ;
+  key(k) ;
+  raw(buff, sprintf(buff, "%d", val)) ;
+  return *this ;
+}
+
+JsonWriter& JsonWriter::num(const char *k, const std::string &val)
+{
+  key(k) ;
+  raw(val.data(), val.size()) ;
+  return *this ;
+}
+
+bool JsonWriter::finish()
+{
+  flush() ;
+  if (_req && _ok)
+    _ok = httpd_resp_send_chunk(_req, nullptr, 0) == ESP_OK ;
+  return _ok ;
+}
+
+void JsonWriter::key(const char *k, size_t size)
+{
+  if (_first)
+    _first = false ;
+  else
+    raw(", ", 2) ;
+
+  if (k)
   {
-    if (first)
-      first = false ;
-    else
-      json += ", " ;
-    json += "\"" + ele + "\"" ;
+    raw("\"", 1) ;
+    escaped(k, size) ;
+    raw("\": ", 3) ;
   }
-  json += " ]" ;
-  return json ;
+}
+
+void JsonWriter::raw(const char *data, size_t size)
+{
+  while (size)
+  {
+    if (_size == sizeof(_buff))
+      flush() ;
+    size_t n = std::min(size, sizeof(_buff) - _size) ;
+    memcpy(_buff + _size, data, n) ;
+    _size += n ;
+    data += n ;
+    size -= n ;
+  }
+}
+
+void JsonWriter::escaped(const char *data, size_t size)
+{
+  const char *begin = data ;
+  const char *end = data + size ;
+  for ( ; data < end ; ++data)
+  {
+    unsigned char ch = *data ;
+    if ((ch >= 0x20) && (ch != '"') && (ch != '\\'))
+      continue ;
+
+    raw(begin, data - begin) ;
+    begin = data + 1 ;
+
+    char buff[8] ;
+    switch (ch)
+    {
+    case '"'  : raw("\\\"", 2) ; break ;
+    case '\\' : raw("\\\\", 2) ; break ;
+    case '\n' : raw("\\n" , 2) ; break ;
+    case '\r' : raw("\\r" , 2) ; break ;
+    case '\t' : raw("\\t" , 2) ; break ;
+    default   : raw(buff, sprintf(buff, "\\u%04x", ch)) ; break ;
+    }
+  }
+  raw(begin, end - begin) ;
+}
+
+void JsonWriter::flush()
+{
+  if (!_size)
+    return ;
+
+  if (_out)
+    _out->append(_buff, _size) ;
+  else if (_ok && (httpd_resp_send_chunk(_req, _buff, _size) != ESP_OK))
+    _ok = false ;
+  _size = 0 ;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -233,6 +354,11 @@ bool SpiFs::write(const std::string &name, const std::string &str)
   return res ;
 }
 
+bool SpiFs::remove(const std::string &name)
+{
+  return ::remove((_root + name).c_str()) == 0 ;
+}
+
 bool SpiFs::df(size_t &total, size_t &used)
 {
   return esp_spiffs_info(_conf.partition_label, &total, &used) == ESP_OK ;
@@ -240,6 +366,16 @@ bool SpiFs::df(size_t &total, size_t &used)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+const Asset* asset(const char *file)
+{
+  for (const Asset *a = assets ; a->_file ; ++a)
+    if (!strcmp(a->_file, file))
+      return a ;
+  return nullptr ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 Camera::Camera()
 {
   // AI Thinker
@@ -269,7 +405,7 @@ Camera::Camera()
   _config.frame_size   = FRAMESIZE_SVGA ; /*!< Size of the output image: FRAMESIZE_ + QVGA|CIF|VGA|SVGA|XGA|SXGA|UXGA  */
 
   _config.jpeg_quality = 5 ;          /*!< Quality of JPEG output. 0-63 lower means higher quality  */
-  _config.fb_count     = 1 ;          /*!< Number of frame buffers to be allocated. If more than one, then each frame will be acquired (double speed)  */
+  _config.fb_count     = 2 ;          /*!< Number of frame buffers to be allocated. If more than one, then each frame will be acquired (double speed)  */
   _config.fb_location  = CAMERA_FB_IN_PSRAM ;     /*!< The location where the frame buffer will be allocated */
   _config.grab_mode    = CAMERA_GRAB_LATEST ;     /*!< When buffers should be filled */
 
@@ -293,7 +429,11 @@ bool Camera::init()
     return false ;
   }
 
-  _inUse = xSemaphoreCreateMutex() ;
+  if (xTaskCreatePinnedToCore(captureTask, "Camera", 4096, this, 5, &_task, 1) != pdPASS)
+  {
+    ESP_LOGE("Camera", "xTaskCreatePinnedToCore() failed") ;
+    return false ;
+  }
   
   if (_light._pin >= 0)
   {
@@ -337,7 +477,12 @@ Camera::Light& Camera::light() { return _light ; }
 
 bool Camera::terminate()
 {
-  vSemaphoreDelete(_inUse) ;
+  if (_task)
+  {
+    vTaskDelete(_task) ;
+    _task = nullptr ;
+  }
+  _frame.reset() ;
 
   if (esp_camera_deinit() != ESP_OK)
     return false ;
@@ -345,27 +490,239 @@ bool Camera::terminate()
   return true ;
 }
 
-bool Camera::capture(Data &data)
+bool Camera::capture(Frame &frame)
+{
+  // single flight: join a grab in progress or request the next one
+  int64_t begin = esp_timer_get_time() ;
+  std::unique_lock<std::mutex> lock(_mutex) ;
+  uint32_t seq{_seq} ;
+  if (!_grabbing)
+  {
+    _requested = true ;
+    _cond.notify_all() ;
+  }
+  ++_snapshots ;
+  bool result = _cond.wait_for(lock, std::chrono::seconds(3), [this, seq]{ return _frame && (_seq != seq) ; }) ;
+  if (result)
+    frame = _frame ;
+  if (!--_snapshots)
+    _cond.notify_all() ; // the idle capture task may return the frame now
+  lock.unlock() ;
+
+  metrics.capture(result, esp_timer_get_time() - begin) ;
+  return result ;
+}
+
+void Camera::captureTask(void *arg)
 {
-  if (!xSemaphoreTake(_inUse, 0))
+  ((Camera*)arg)->produce() ;
+}
+
+void Camera::produce()
+{
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(_mutex) ;
+      // the snapshots woken by the last frame take it before it goes back to the driver
+      _cond.wait(lock, [this]{ return !_snapshots || !_streams.empty() || _requested ; }) ;
+      if (_streams.empty() && !_requested)
+      {
+        _frame.reset() ;
+        _light.capture(false) ;
+        do
+        {
+          applyBatch(lock) ;
+          _cond.wait(lock, [this]{ return !_streams.empty() || _requested || _batch ; }) ;
+        } while (_streams.empty() && !_requested) ;
+        _light.capture(true) ;
+        if (_light.mode() == Light::Mode::capture)
+          invalidate() ;
+      }
+      applyBatch(lock) ; // the driver is not waited for while the sensor changes
+      _requested = false ;
+      _grabbing = true ;
+
+      // fb_count buffers only, a stream still sending one blocks the grab for all,
+      // it stays slow until it is found waiting for a frame (pacing tells nothing)
+      for (Stream *stream : _streams)
+      {
+        if (!stream->_taken.expired())
+          stream->_slow = true ;
+        else if (stream->_waiting)
+          stream->_slow = false ;
+      }
+    }
+
+    // discard buffered frames only if they are older than the last change or the sensor was idle
+    int64_t begin = esp_timer_get_time() ;
+    camera_fb_t* fb = esp_camera_fb_get() ;
+    for (uint8_t retry = 0 ; fb && !fresh(fb) && (retry < 3) ; ++retry)
+    {
+      esp_camera_fb_return(fb) ;
+      fb = esp_camera_fb_get() ;
+    }
+    metrics.grab(fb != nullptr, esp_timer_get_time() - begin) ;
+    if (!fb)
+    {
+      ESP_LOGE("Camera", "esp_camera_fb_get() failed") ;
+      {
+        std::lock_guard<std::mutex> lock(_mutex) ;
+        _grabbing = false ;
+        _requested = _snapshots > 0 ; // retry for the waiting snapshots
+      }
+      vTaskDelay(100 / portTICK_PERIOD_MS) ;
+      continue ;
+    }
+
+    Frame frame(fb, esp_camera_fb_return) ;
+    {
+      std::lock_guard<std::mutex> lock(_mutex) ;
+      _frame.swap(frame) ;
+      ++_seq ;
+      _grabbing = false ;
+      for (Stream *stream : _streams)
+      {
+        if (stream->_pending && !stream->_pacing)
+          ++stream->_dropped ;
+        stream->_pending = _frame ;
+      }
+    }
+    _cond.notify_all() ;
+    // previous frame is returned to the driver here unless a stream still sends it
+  }
+}
+
+bool Camera::fresh(const camera_fb_t *fb) const
+{
+  int64_t timestamp = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec ;
+  return (timestamp >= _freshAfter) && ((esp_timer_get_time() - timestamp) < 500000) ;
+}
+
+void Camera::invalidate()
+{
+  _freshAfter = esp_timer_get_time() ;
+}
+
+bool Camera::apply(const std::function<bool()> &batch, bool &result)
+{
+  // one batch at a time, all its changes land between the same two frames
+  Batch b{batch, false, false} ;
+  std::unique_lock<std::mutex> lock(_mutex) ;
+  if (!_cond.wait_for(lock, std::chrono::seconds(3), [this]{ return !_batch && !_applying ; }))
     return false ;
+  _batch = &b ;
+  _cond.notify_all() ;
+  if (!_cond.wait_for(lock, std::chrono::seconds(3), [&b]{ return b._done ; }))
+  {
+    if (_batch == &b)
+    {
+      _batch = nullptr ; // the capture task is stuck in a grab, the batch never ran
+      return false ;
+    }
+    _cond.wait(lock, [&b]{ return b._done ; }) ; // running, it still uses b
+  }
+  result = b._result ;
+  return true ;
+}
 
-  _light.capture(true) ;
-  
-  camera_fb_t* fb0 = esp_camera_fb_get() ;
-  esp_camera_fb_return(fb0) ;
-  
-  camera_fb_t* fb = esp_camera_fb_get() ;
-  if (fb)
+void Camera::applyBatch(std::unique_lock<std::mutex> &lock)
+{
+  if (!_batch)
+    return ;
+  _applying = _batch ;
+  _batch = nullptr ;
+  lock.unlock() ;
+  bool result = _applying->_fn() ;
+  lock.lock() ;
+  _applying->_result = result ;
+  _applying->_done = true ;
+  _applying = nullptr ;
+  _cond.notify_all() ;
+}
+
+std::vector<Camera::StreamStats> Camera::streamStats()
+{
+  std::lock_guard<std::mutex> lock(_mutex) ;
+  std::vector<StreamStats> stats ;
+  for (const Stream *stream : _streams)
+    stats.push_back({ stream->_frames, stream->_dropped, stream->_bytes, stream->_id }) ;
+  return stats ;
+}
+
+Camera::StreamStats Camera::streamTotals()
+{
+  std::lock_guard<std::mutex> lock(_mutex) ;
+  StreamStats stats = _streamTotals ;
+  for (const Stream *stream : _streams)
   {
-    data.assign(fb->buf, fb->buf + fb->len) ;
-    esp_camera_fb_return(fb) ;
+    stats._frames  += stream->_frames ;
+    stats._dropped += stream->_dropped ;
+    stats._bytes   += stream->_bytes ;
   }
+  return stats ;
+}
 
-  _light.capture(false) ;
-  
-  xSemaphoreGive(_inUse) ;
-  return fb != nullptr ;
+Frame Camera::detach(const Frame &frame)
+{
+  uint8_t *buf = (uint8_t*) heap_caps_malloc(frame->len, MALLOC_CAP_SPIRAM) ;
+  if (!buf)
+    return frame ;
+
+  memcpy(buf, frame->buf, frame->len) ;
+  camera_fb_t *fb = new camera_fb_t(*frame) ;
+  fb->buf = buf ;
+  return Frame(fb, [](camera_fb_t *fb) { free(fb->buf) ; delete fb ; }) ;
+}
+
+Camera::Stream::Stream(Camera &camera) : _camera{camera}
+{
+  {
+    std::lock_guard<std::mutex> lock(_camera._mutex) ;
+    _id = ++_camera._streamIds ;
+    _camera._streams.push_back(this) ;
+  }
+  _camera._cond.notify_all() ;
+}
+
+Camera::Stream::~Stream()
+{
+  std::lock_guard<std::mutex> lock(_camera._mutex) ;
+  _camera._streams.erase(std::find(_camera._streams.begin(), _camera._streams.end(), this)) ;
+  _camera._streamTotals._frames  += _frames ;
+  _camera._streamTotals._dropped += _dropped ;
+  _camera._streamTotals._bytes   += _bytes ;
+  _pending.reset() ;
+}
+
+void Camera::Stream::sent(size_t bytes)
+{
+  std::lock_guard<std::mutex> lock(_camera._mutex) ;
+  _bytes += bytes ;
+  _pacing = true ;
+}
+
+bool Camera::Stream::next(Frame &frame)
+{
+  frame.reset() ;
+  std::unique_lock<std::mutex> lock(_camera._mutex) ;
+  _pacing = false ;
+  _waiting = true ;
+  bool ready = _camera._cond.wait_for(lock, std::chrono::seconds(5), [this]{ return (bool)_pending ; }) ;
+  _waiting = false ;
+  if (!ready)
+    return false ;
+
+  frame.swap(_pending) ;
+  ++_frames ;
+  if (_slow)
+  {
+    lock.unlock() ;
+    frame = detach(frame) ; // a slow client must not hold a driver buffer
+    lock.lock() ;
+  }
+  _taken = frame ;
+  return true ;
 }
 
 bool Camera::Light::brightness(uint8_t b)
@@ -570,6 +927,9 @@ void setup()
 
   if (!httpd.start())
     esp_restart() ;
+
+  if (!otaPull.init())
+    ESP_LOGE("Esp32Cam", "otaPull.init() failed") ;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
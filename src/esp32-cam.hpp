@@ -4,23 +4,36 @@
 
 #include <esp_log.h>
 #include <esp_https_server.h>
+#include <esp_idf_version.h>
 #include <esp_camera.h>
 #include <esp_spiffs.h>
 #include <esp_ota_ops.h>
+#include <esp_http_client.h>
 #include <esp_heap_caps.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <mbedtls/md.h>
+#include <mbedtls/sha256.h>
+#include <esp32/rom/miniz.h>
 #include <freertos/timers.h>
+#include <freertos/queue.h>
 
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <map>
+#include <memory>
 #include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 ////////////////////////////////////////////////////////////////////////////////
 
 using Data = std::vector<uint8_t> ;
+using Frame = std::shared_ptr<camera_fb_t> ; // frame buffer is returned to the driver with the last reference
 #include "settings.hpp"
+#include "memmem.hpp"
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -36,6 +49,7 @@ public:
 
   bool read(const std::string &name, std::string &str) ;
   bool write(const std::string &name, const std::string &str) ;
+  bool remove(const std::string &name) ;
 
   bool df(size_t &total, size_t &used) ;
   
@@ -48,6 +62,22 @@ extern SpiFs spifs ;
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct Asset // web ui file compiled into the firmware, see tools/embed-assets.py
+{
+  const char    *_file ;
+  const uint8_t *_data ;
+  size_t         _size ;
+  const uint8_t *_gzip ;      // nullptr if compression does not pay off
+  size_t         _gzipSize ;
+  const char    *_etag ;
+  const char    *_gzipEtag ;
+} ;
+
+extern const Asset assets[] ; // terminated by _file == nullptr
+const Asset* asset(const char *file) ;
+
+////////////////////////////////////////////////////////////////////////////////
+
 class Camera
 {
 public:
@@ -73,11 +103,48 @@ public:
     int _pin{-1} ;
   } ;
 
+  class Stream // continuous consumer of the frames published by the capture task
+  {
+    friend class Camera ;
+  public:
+    Stream(Camera &camera) ;
+    ~Stream() ;
+
+    bool next(Frame &frame) ;
+    void sent(size_t bytes) ; // frame done, the stream paces until the next call to next()
+
+  private:
+    Camera &_camera ;
+    Frame    _pending ;     // send queue, holds the newest frame only
+    std::weak_ptr<camera_fb_t> _taken ; // last frame handed out by next()
+    bool     _slow{false} ; // held it when a grab was due, until it waits for a frame again
+    bool     _waiting{false} ; // inside next()
+    bool     _pacing{false} ;  // between sent() and next(), replaced frames are no drops
+    uint32_t _id ;          // stable metrics label, the vector index is not
+    uint32_t _frames{0} ;
+    uint32_t _dropped{0} ;  // replaced before the client, ready for them, took them
+    uint64_t _bytes{0} ;
+  } ;
+
+  struct StreamStats
+  {
+    uint32_t _frames ;
+    uint32_t _dropped ;
+    uint64_t _bytes ;
+    uint32_t _id ;
+  } ;
+
   Camera() ;
   bool init() ;
   bool terminate() ;
 
-  bool capture(Data &data) ;
+  bool capture(Frame &frame) ;
+  void invalidate() ; // frames captured before now are stale (settings changed)
+  bool apply(const std::function<bool()> &batch, bool &result) ; // by the capture task between two grabs, false on timeout
+  std::vector<StreamStats> streamStats() ; // active streams
+  StreamStats streamTotals() ;             // all streams since boot
+
+  static Frame detach(const Frame &frame) ; // copy to PSRAM, the driver buffer is returned early
   
   const sensor_t& sensor() const ;
   sensor_t& sensor() ;
@@ -89,13 +156,207 @@ private:
   camera_config_t _config ;
   sensor_t    *_sensor{nullptr} ;
   Light _light ;
-  SemaphoreHandle_t _inUse ;
+
+  struct Batch
+  {
+    const std::function<bool()> &_fn ;
+    bool _result ;
+    bool _done ;
+  } ;
+
+  static void captureTask(void *arg) ;
+  void produce() ;
+  void applyBatch(std::unique_lock<std::mutex> &lock) ;
+  bool fresh(const camera_fb_t *fb) const ;
+
+  TaskHandle_t _task{nullptr} ;
+  std::mutex _mutex ;
+  std::condition_variable _cond ;
+  Frame    _frame ;     // latest published frame
+  uint32_t _seq{0} ;    // incremented with every published frame
+  std::vector<Stream*> _streams ;
+  StreamStats _streamTotals{} ;  // of the ended streams
+  uint32_t _streamIds{0} ;
+  uint32_t _snapshots{0} ;     // waiting snapshots
+  bool     _requested{false} ; // snapshot waiting for the next grab
+  bool     _grabbing{false} ;  // grab in progress, snapshots join it
+  Batch   *_batch{nullptr} ;   // sensor changes waiting for the capture task
+  Batch   *_applying{nullptr} ;
+  std::atomic<int64_t> _freshAfter{0} ; // esp_timer_get_time() of the last invalidate()
 } ;
 
 extern Camera camera ;
 
 ////////////////////////////////////////////////////////////////////////////////
 
+class FrameRate // paces a stream at the requested fps, backs off while the socket falls behind
+{
+public:
+  FrameRate(uint8_t fps) ;
+
+  void fps(uint8_t fps) ;
+  void begin() ;     // frame send starts
+  void end() ;       // frame send done
+  TickType_t delay() const ; // wait before the next frame
+
+private:
+  int64_t _target ;      // requested frame interval [us]
+  int64_t _send{0} ;     // smoothed send duration [us]
+  int64_t _begin{0} ;
+} ;
+
+class StreamSession ;
+
+class StreamWriter // gathers small writes so that each TLS record is filled
+{
+public:
+  StreamWriter(StreamSession &session) ;
+  ~StreamWriter() ;
+
+  bool write(const void *data, size_t size) ;
+  bool flush() ;
+
+private:
+  bool send(const uint8_t *data, size_t size) ;
+
+#ifdef CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+  static constexpr size_t _capacity{CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN} ;
+#else
+  static constexpr size_t _capacity{4096} ;
+#endif
+  StreamSession &_session ;
+  uint8_t *_buff ;
+  size_t   _size{0} ;
+} ;
+
+class StreamSession // long running response, handed from the httpd task to a stream worker
+{
+  friend class StreamPool ;
+  friend class Events ;
+public:
+  StreamSession(httpd_req_t *req) ;
+  virtual ~StreamSession() ;
+
+  virtual void run() = 0 ; // runs in a stream worker
+  bool open() const ;      // false once httpd closed the socket
+  bool send(const void *data, size_t size) ; // blocks the calling task only, up to _sendTimeout
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  bool send(httpd_ws_frame_t &frame) ;
+#endif
+  bool writable() ;        // a send would not block
+  void touch() ;           // keeps the socket out of the httpd lru purge
+  void close() ;           // unless httpd closed it already
+  void retain() ;
+  void release() ;
+
+  static void closed(void *ctx) ; // httpd session free_ctx
+
+protected:
+  void attach(httpd_req_t *req) ; // httpd task, hands the socket over
+  bool owns() const ;             // httpd task only
+
+  static constexpr int _sendTimeout{2} ; // [s] a stalled client ends its session
+  httpd_handle_t _hd ;
+  int            _sockfd ;
+
+private:
+  static int sendFn(httpd_handle_t hd, int sockfd, const char *buf, size_t size, int flags) ;
+  static int recvFn(httpd_handle_t hd, int sockfd, char *buf, size_t size, int flags) ;
+  static void closeWork(void *arg) ;
+  static void touchWork(void *arg) ;
+
+  std::recursive_mutex _mutex ;     // socket use of the worker and the httpd task, closed() waits for it
+  std::atomic<bool>    _open{true} ;
+  std::atomic<uint8_t> _refs{2} ;   // httpd session and stream worker, plus queued work
+  int64_t              _touched{0} ; // [us] last touch()
+} ;
+
+class MjpegSession : public StreamSession // multipart/x-mixed-replace jpeg stream
+{
+public:
+  MjpegSession(httpd_req_t *req, uint8_t fps) ;
+  virtual void run() ;
+
+private:
+  uint8_t _fps ;
+} ;
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+class WsSession : public StreamSession // one binary websocket message per jpeg, controlled by text messages
+{
+public:
+  WsSession(httpd_req_t *req) ;
+  virtual void run() ;
+
+  bool control(const std::string &key, const std::string &value) ; // httpd task
+
+private:
+  std::atomic<uint8_t> _fps{5} ;
+  std::atomic<bool>    _paused{false} ;
+} ;
+#endif
+
+class StreamPool
+{
+public:
+  bool init(uint8_t size, BaseType_t core) ;
+  bool start(httpd_req_t *req, StreamSession *session) ; // false if all workers are busy
+
+private:
+  static void worker(void *arg) ;
+
+  QueueHandle_t _queue{nullptr} ;
+  std::atomic<uint8_t> _idle{0} ; // workers not yet reserved by start()
+} ;
+
+extern StreamPool streamPool ;
+
+class EventSession : public StreamSession // text/event-stream subscriber of /events
+{
+public:
+  EventSession(httpd_req_t *req) ;
+  virtual void run() ; // sends the current snapshot, runs in the events task
+
+  bool failed() const ;
+
+private:
+  static constexpr uint8_t _stallMax{10} ; // snapshots skipped in a row before the subscriber is dropped
+
+  std::atomic<bool> _failed{false} ;
+  uint8_t _stalled{0} ;
+} ;
+
+class Events // telemetry for /events, serialized once per interval for all subscribers
+{
+public:
+  bool init() ;
+  bool subscribe(httpd_req_t *req) ;
+  void interval(uint16_t ms) ;
+
+  std::shared_ptr<const std::string> snapshot() const ;
+
+private:
+  static void eventsTask(void *arg) ;
+  void produce() ;
+  std::string telemetry() ;
+
+  TaskHandle_t _task{nullptr} ;
+  mutable std::mutex _mutex ;
+  std::vector<EventSession*> _sessions ;
+  std::shared_ptr<const std::string> _snapshot ;
+  std::atomic<uint16_t> _interval{1000} ; // [ms]
+
+  // previous totals for the rates
+  int64_t  _time{0} ;
+  uint32_t _frames{0} ;
+  uint32_t _grabs{0} ;
+  uint64_t _grabSum{0} ;
+} ;
+
+extern Events events ;
+
+////////////////////////////////////////////////////////////////////////////////
+
 class HTTPD
 {
   struct FileInfo
@@ -103,6 +364,7 @@ class HTTPD
     const char *_url ;
     const char *_type ;
     const char *_file ;
+    const char *_cacheControl ;
   } ;
 
 public:
@@ -115,12 +377,25 @@ public:
 
   static esp_err_t getFile(httpd_req_t *req) ;
   static esp_err_t redirect(httpd_req_t *req, const char *location) ;
+
+  uint32_t tlsHandshakes() const ; // all, full and resumed
+  uint32_t tlsResumes() const ;    // resumed with a session ticket
   
 private:
+  static esp_err_t sendFile(httpd_req_t *req, const FileInfo &fi, const uint8_t *data, size_t size, const char *etag) ;
+  static bool notModified(httpd_req_t *req, const char *etag) ; // sends 304 if the client has etag
+  static esp_err_t set(httpd_req_t *req, const char *buff, size_t size) ; // key=value&... batch
+  static esp_err_t timed(httpd_req_t *req) ;
+  bool registerTimed(const httpd_uri_t &uri) ;
+
   httpd_handle_t    _httpd{nullptr} ;
   Mode              _mode{Mode::none} ;
   std::string       _certPem ;
   std::string       _keyPem ;
+  std::atomic<uint32_t> _tlsHandshakes{0} ;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+  static void tlsSession(esp_https_server_user_cb_arg_t *arg) ;
+#endif
   static const FileInfo _staticUriCommon[] ;      // static content for modes setup & running
   static const FileInfo _staticUriSetup[] ;       // static content for mode setup
   static const FileInfo _staticUriRunning[] ;     // static content for mode running 
@@ -133,42 +408,197 @@ extern HTTPD httpd ;
 ////////////////////////////////////////////////////////////////////////////////
 
 
-class MultiPart
+class MultiPart // streaming multipart/form-data parser, part bodies are handed over in blocks as they arrive
 {
 public:
-  struct Part
-  {
-    Part() ;
-    Part(const uint8_t *hb, const uint8_t *he, const uint8_t *bb, const uint8_t *be) ;
-
-    uint32_t headSize() const ;
-    uint32_t bodySize() const ;
-    
-    const uint8_t *_headBegin ;
-    const uint8_t *_headEnd ;
-    const uint8_t *_bodyBegin ;
-    const uint8_t *_bodyEnd ;
-  } ;
+  using BeginFn = std::function<bool(const std::string &name)> ;
+  using DataFn  = std::function<bool(const uint8_t *data, size_t size)> ;
+  using EndFn   = std::function<bool()> ;
+  using Fields  = std::map<std::string, std::string> ;
 
 public:
   MultiPart(httpd_req_t *req) ;
   ~MultiPart() ;
   
-  bool parse() ;
-  bool get(const std::string &name, Part &part) ;
+  // callbacks return false to stop, they send the response themselves
+  bool parse(const BeginFn &beginFn, const DataFn &dataFn, const EndFn &endFn) ;
+  bool parse(Fields &fields, size_t fieldMax) ; // small form fields only
   
 private:
-  using PartByName = std::map<std::string, Part> ;
+  enum class State { Preamble, Delimiter, Head, Body, Done } ;
 
-  bool parseBody(const uint8_t *boundary, size_t boundarySize, const uint8_t *data, size_t dataSize) ;
+  bool header(char *boundary, size_t boundaryMax, size_t &boundarySize) ;
   bool parseName(const uint8_t *head, size_t headSize, std::string &name) ;            
-  
+
+  static constexpr size_t _buffSize{4096} ;
   httpd_req_t *_req ;
-  uint8_t     *_content ;
-  PartByName   _parts ;
+  uint8_t     *_buff ;
 } ;
 
-extern const uint8_t* memmem(const uint8_t *buff, size_t size, const uint8_t *pattern, size_t patternSize) ;
+////////////////////////////////////////////////////////////////////////////////
+
+class OtaWriter // receives into one buffer while a task on the other core flashes the other
+{
+public:
+  // the app description of the image, false skips it before anything is written
+  using AppFn = std::function<bool(const esp_app_desc_t &app)> ;
+
+  OtaWriter() ;
+  ~OtaWriter() ; // aborts an unfinished update
+
+  bool begin(const AppFn &appFn = nullptr) ; // one update at a time
+  bool write(const uint8_t *data, size_t size) ;
+  bool end(uint8_t sha256[32]) ; // flushes, waits for the writer and esp_ota_end
+  bool boot() ;
+
+  const char* msg() const { return _msg ; } // why the last call failed
+  std::string stats() const ;
+
+private:
+  struct Chunk
+  {
+    uint8_t *_data ;
+    size_t   _size ;
+  } ;
+
+  static void writerTask(void *arg) ;
+  void writer() ;
+  bool stop() ;
+  bool app() ;
+  bool fail(const char *fn, esp_err_t err) ;
+
+  static constexpr size_t _buffSize{8192} ;
+  static constexpr size_t _headSize{sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)} ;
+  static std::atomic<bool> _active ;
+  bool _owner{false} ;
+  AppFn   _appFn ;
+  uint8_t _head[_headSize] ; // first bytes of the image
+  uint8_t *_buffs[2]{} ;
+  Chunk    _fill{} ;
+  QueueHandle_t     _free{nullptr} ;   // buffers the receiver may fill
+  QueueHandle_t     _full{nullptr} ;   // buffers for the writer, null data stops it
+  SemaphoreHandle_t _done{nullptr} ;
+  bool _running{false} ;
+
+  const esp_partition_t *_part{nullptr} ;
+  esp_ota_handle_t       _ota{0} ;      // esp_ota_begin() with the first buffer
+  std::atomic<esp_err_t> _err{ESP_OK} ;
+  const char            *_errFn{"esp_ota_write"} ;
+  mbedtls_sha256_context _sha ;
+
+  size_t  _size{0} ;
+  int64_t _begin{0} ;     // [us]
+  int64_t _end{0} ;       // [us]
+  int64_t _stall{0} ;     // [us] receiver waiting for a free buffer
+  int64_t _flash{0} ;     // [us] writer busy in esp_ota_write
+  char    _msg[64]{} ;
+} ;
+
+////////////////////////////////////////////////////////////////////////////////
+
+class OtaDecoder // raw, zlib and delta images (see tools/ota-image.py) on their way to OtaWriter
+{
+public:
+  OtaDecoder(OtaWriter &writer) : _writer(writer) {}
+  ~OtaDecoder() ;
+
+  bool write(const uint8_t *data, size_t size) ; // format is detected by the first bytes
+  bool end() ;                                   // checks the image is complete
+
+  const char* msg() const { return _msg ; }
+  std::string format() const ;
+
+private:
+  enum class Format : uint8_t { Unknown, Raw, Delta } ;
+  enum class State : uint8_t { Header, Op, Data, Done } ;
+
+  struct DeltaHeader // followed by ops: 'C' offset length, 'D' length data, 'E'
+  {
+    char     _magic[4] ;    // "ESPD"
+    uint8_t  _format ;
+    uint8_t  _reserved[3] ;
+    uint32_t _oldSize ;
+    uint32_t _newSize ;
+    uint8_t  _oldSha256[32] ; // of the first oldSize bytes of the running partition
+  } ;
+
+  bool inflate(const uint8_t *data, size_t size) ;
+  bool image(const uint8_t *data, size_t size) ;
+  bool delta(const uint8_t *data, size_t size) ;
+  bool header() ;
+  bool op() ;
+  bool copy(uint32_t offset, uint32_t length) ;
+  bool output(const uint8_t *data, size_t size) ;
+  bool fail(const char *msg) ;
+
+  static constexpr uint8_t  _deltaFormat{1} ;
+  static constexpr size_t   _copySize{4096} ;
+  OtaWriter &_writer ;
+  Format     _format{Format::Unknown} ;
+  bool       _zlib{false} ;
+  size_t     _received{0} ;
+
+  tinfl_decompressor *_inflator{nullptr} ;
+  tinfl_status        _inflateStatus{TINFL_STATUS_NEEDS_MORE_INPUT} ;
+  uint8_t            *_dict{nullptr} ;  // TINFL_LZ_DICT_SIZE, wraps around
+  size_t              _dictOfs{0} ;
+
+  State    _state{State::Header} ;
+  uint8_t  _field[sizeof(DeltaHeader)] ;
+  size_t   _fieldSize{0} ;
+  size_t   _fieldNeed{sizeof(DeltaHeader)} ;
+  uint32_t _dataSize{0} ;
+  uint32_t _oldSize{0} ;
+  uint32_t _newSize{0} ;
+  uint32_t _written{0} ;
+  const esp_partition_t *_running{nullptr} ;
+  uint8_t *_copy{nullptr} ;
+
+  char _msg[64]{} ;
+} ;
+
+////////////////////////////////////////////////////////////////////////////////
+
+class OtaPull // fetches the firmware from ota.url, interrupted downloads resume with range requests
+{
+public:
+  bool init() ;                // polls every ota.interval minutes, or on trigger() only
+  bool trigger(const std::string &sha256) ; // false without ota.url, sha256 replaces ota.sha256 once
+  std::string status() const ; // of the last check
+
+private:
+  static void pullTask(void *arg) ;
+  static esp_err_t event(esp_http_client_event_t *evt) ;
+  void pull() ;
+  bool update(const std::string &url, const std::string &expected) ;
+  bool accept(const esp_app_desc_t &app) ; // not running yet and past the stage delay
+  void saveSeen() ;
+  void status(const std::string &status) ;
+
+  static constexpr int    _retries{8} ;
+  static constexpr size_t _chunkSize{4096} ;
+  TaskHandle_t      _task{nullptr} ;
+  SemaphoreHandle_t _trigger{nullptr} ;
+  uint32_t _interval{0} ;    // [min]
+  uint32_t _stageDelay{0} ;  // [h] staged rollout, wait after a new image shows up
+  struct Seen // newest image seen, kept in nvs so a reboot does not restart the stage delay
+  {
+    uint8_t  _sha[32] ;      // app_elf_sha256
+    uint32_t _for ;          // [s] uptime since it showed up
+  } ;
+  Seen     _seen{} ;
+  int64_t  _checked{0} ;     // [us] of the previous accept(), 0 is boot
+  bool     _skipped{false} ;
+
+  std::string _etag ;        // of the last response
+  int64_t     _rangeStart{-1} ;
+
+  mutable std::mutex _mutex ;
+  std::string _status{"no check yet"} ;
+  std::string _sha256 ;      // of trigger()
+} ;
+
+extern OtaPull otaPull ;
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -189,6 +619,46 @@ extern Crypto crypto ;
 
 ////////////////////////////////////////////////////////////////////////////////
 
+class Histogram // latency histogram for /metrics
+{
+public:
+  void observe(int64_t us) ;
+  void text(std::string &text, const char *name, const char *labels) const ;
+  uint32_t count() const ;
+  uint64_t sum() const ; // [us]
+
+private:
+  static constexpr uint32_t _bounds[] = { 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000 } ; // [ms]
+  static constexpr size_t _size = sizeof(_bounds) / sizeof(_bounds[0]) ;
+  std::atomic<uint32_t> _buckets[_size+1]{} ;
+  std::atomic<uint64_t> _sum{0} ; // [us]
+} ;
+
+class Metrics // counters for /metrics (prometheus text format)
+{
+public:
+  void capture(bool ok, int64_t us) ; // Camera::capture()
+  void grab(bool ok, int64_t us) ;    // sensor readout in the capture task
+  void request(const char *uri, int64_t us) ;
+  void tlsHandshake(int64_t us) ;     // accept to the end of the handshake
+  void uri(const char *uri) ;         // all uris, before the server starts
+  const Histogram& grabs() const { return _grab ; }
+
+  std::string text() ;
+
+private:
+  std::atomic<uint32_t> _captureFailed{0} ;
+  std::atomic<uint32_t> _grabFailed{0} ;
+  Histogram _capture ;
+  Histogram _grab ;
+  Histogram _tlsHandshake ;
+  std::map<std::string, Histogram> _requests ;
+} ;
+
+extern Metrics metrics ;
+
+////////////////////////////////////////////////////////////////////////////////
+
 class Terminator
 {
 public:
@@ -204,6 +674,7 @@ extern Terminator terminator ;
 ////////////////////////////////////////////////////////////////////////////////
 
 extern esp_err_t ota(httpd_req_t *req) ;
+extern esp_err_t pull(httpd_req_t *req) ;
 extern esp_err_t wifiSetup(httpd_req_t *req) ;
 
 void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) ;
@@ -217,10 +688,40 @@ std::string to_s(T i) ;
 template<class T>
 bool to_i(const std::string &s, T &i) ;
 
-std::string jsonStr(const std::string &key, const std::string &val) ;
-std::string jsonInt(const std::string &key, const std::string &val) ;
-std::string jsonInt(const std::string &key, int32_t val) ;
-std::string jsonArr(const std::string &key, const std::vector<std::string> &arr) ;
+class JsonWriter // appends json through one fixed buffer into a string or httpd response chunks
+{
+public:
+  JsonWriter(std::string &out) ;  // caller reserves the string
+  JsonWriter(httpd_req_t *req) ;  // chunked response
+  
+  JsonWriter& obj(const char *key = nullptr) ;
+  JsonWriter& obj(const char *key, size_t size) ;
+  JsonWriter& arr(const char *key = nullptr) ;
+  JsonWriter& end() ;             // closes the innermost object or array
+  JsonWriter& str(const char *key, const char *val) ;
+  JsonWriter& str(const char *key, const std::string &val) ;
+  JsonWriter& num(const char *key, int32_t val) ;
+  JsonWriter& num(const char *key, const std::string &val) ; // already formatted
+  
+  bool finish() ;                 // false if a chunk could not be sent
+
+private:
+  void key(const char *k) { key(k, k ? strlen(k) : 0) ; }
+  void key(const char *key, size_t size) ;
+  void raw(const char *data, size_t size) ;
+  void raw(const char *str) { raw(str, strlen(str)) ; }
+  void escaped(const char *data, size_t size) ;
+  void flush() ;
+
+  std::string *_out{nullptr} ;
+  httpd_req_t *_req{nullptr} ;
+  char     _buff[256] ;
+  size_t   _size{0} ;
+  uint32_t _nested{0} ;  // bit per level, set when the level is an array
+  uint8_t  _level{0} ;
+  bool     _first{true} ;
+  bool     _ok{true} ;
+} ;
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -0,0 +1,207 @@
+////////////////////////////////////////////////////////////////////////////////
+// events.cpp
+////////////////////////////////////////////////////////////////////////////////
+
+#include "esp32-cam.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+
+Events events ;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool sendAll(httpd_handle_t hd, int sockfd, const std::string &data)
+{
+  const char *d = data.data() ;
+  size_t size = data.size() ;
+  while (size)
+  {
+    int n = httpd_socket_send(hd, sockfd, d, size, 0) ;
+    if (n <= 0)
+    {
+      ESP_LOGD("Events", "httpd_socket_send() failed %d", n) ;
+      return false ;
+    }
+    d += n ;
+    size -= n ;
+  }
+  return true ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+EventSession::EventSession(httpd_req_t *req) :
+  StreamSession(req)
+{
+}
+
+void EventSession::run()
+{
+  std::shared_ptr<const std::string> snapshot = events.snapshot() ;
+  if (!snapshot || failed())
+    return ;
+
+  // a subscriber that can not take the snapshot right away skips it, the others do not wait
+  if (!writable())
+  {
+    _failed = ++_stalled >= _stallMax ;
+    return ;
+  }
+  _stalled = 0 ;
+  _failed = !send(snapshot->data(), snapshot->size()) ;
+  touch() ;
+}
+
+bool EventSession::failed() const
+{
+  return _failed || !open() ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool Events::init()
+{
+  if (_task)
+    return true ;
+
+  if (xTaskCreatePinnedToCore(eventsTask, "Events", 4096, this, 2, &_task, tskNO_AFFINITY) != pdPASS)
+  {
+    ESP_LOGE("Events", "xTaskCreatePinnedToCore() failed") ;
+    _task = nullptr ;
+    return false ;
+  }
+  return true ;
+}
+
+void Events::interval(uint16_t ms)
+{
+  _interval = ms ;
+}
+
+std::shared_ptr<const std::string> Events::snapshot() const
+{
+  std::lock_guard<std::mutex> lock(_mutex) ;
+  return _snapshot ;
+}
+
+bool Events::subscribe(httpd_req_t *req)
+{
+  static const std::string head =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-store\r\n"
+    "\r\n"
+    "retry: 5000\n\n" ;
+
+  if (!_task)
+    return false ;
+
+  EventSession *session = new EventSession(req) ;
+  if (!sendAll(req->handle, httpd_req_to_sockfd(req), head))
+  {
+    delete session ;
+    return false ;
+  }
+
+  session->attach(req) ;
+
+  std::lock_guard<std::mutex> lock(_mutex) ;
+  _sessions.push_back(session) ;
+  return true ;
+}
+
+void Events::eventsTask(void *arg)
+{
+  Events &events = *(Events*) arg ;
+  events.produce() ;
+}
+
+void Events::produce()
+{
+  TickType_t wake = xTaskGetTickCount() ;
+  while (true)
+  {
+    vTaskDelayUntil(&wake, std::max<TickType_t>(_interval / portTICK_PERIOD_MS, 1)) ;
+
+    std::vector<EventSession*> sessions ;
+    {
+      std::lock_guard<std::mutex> lock(_mutex) ;
+      sessions = _sessions ;
+    }
+    if (sessions.empty())
+    {
+      _time = 0 ;
+      continue ;
+    }
+
+    // one serialization for all subscribers
+    std::shared_ptr<const std::string> snapshot = std::make_shared<const std::string>("data: " + telemetry() + "\n\n") ;
+    {
+      std::lock_guard<std::mutex> lock(_mutex) ;
+      _snapshot = snapshot ;
+    }
+
+    for (EventSession *session : sessions)
+    {
+      session->run() ;
+      if (!session->failed())
+        continue ;
+
+      session->close() ;
+      {
+        std::lock_guard<std::mutex> lock(_mutex) ;
+        _sessions.erase(std::find(_sessions.begin(), _sessions.end(), session)) ;
+      }
+      session->release() ;
+    }
+  }
+}
+
+std::string Events::telemetry()
+{
+  int64_t time = esp_timer_get_time() ;
+  Camera::StreamStats totals = camera.streamTotals() ;
+  const Histogram &grabs = metrics.grabs() ;
+  uint32_t grabCount = grabs.count() ;
+  uint64_t grabSum = grabs.sum() ;
+
+  // rates since the previous event, zero for the first one
+  uint32_t fps10{0} ;
+  uint32_t latency{0} ;
+  if (_time)
+  {
+    int64_t elapsed = time - _time ;
+    if (elapsed > 0)
+      fps10 = (uint64_t)(totals._frames - _frames) * 10000000 / elapsed ;
+    if (grabCount != _grabs)
+      latency = (grabSum - _grabSum) / (grabCount - _grabs) / 1000 ;
+  }
+  _time = time ;
+  _frames = totals._frames ;
+  _grabs = grabCount ;
+  _grabSum = grabSum ;
+
+  int8_t rssi{0} ;
+  {
+    wifi_ap_record_t ap ;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+      rssi = ap.rssi ;
+  }
+
+  size_t clients ;
+  {
+    std::lock_guard<std::mutex> lock(_mutex) ;
+    clients = _sessions.size() ;
+  }
+
+  char buff[192] ;
+  snprintf(buff, sizeof(buff),
+           "{\"heap\":%u,\"psram\":%u,\"fps\":%u.%u,\"rssi\":%d,\"latency\":%u,\"streams\":%u,\"subscribers\":%u}",
+           (uint32_t) heap_caps_get_free_size(MALLOC_CAP_INTERNAL), (uint32_t) heap_caps_get_free_size(MALLOC_CAP_SPIRAM),
+           fps10 / 10, fps10 % 10, rssi, latency, (uint32_t) camera.streamStats().size(), (uint32_t) clients) ;
+  return buff ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// EOF
+////////////////////////////////////////////////////////////////////////////////
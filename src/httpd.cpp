@@ -4,38 +4,55 @@
 
 #include "esp32-cam.hpp"
 
+#ifdef CONFIG_ESP_TLS_SERVER_SESSION_TICKETS
+#include <mbedtls/ssl_ticket.h>
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 HTTPD  httpd ;
 
 ////////////////////////////////////////////////////////////////////////////////
 
-std::string infoJson()
+void infoJson(JsonWriter &json)
 {
-  std::string json ;
   std::string str ;
 
-  json += "{ " ;
+  json.obj() ;
   
   publicSettings.get("esp.name", str) ;
-  json += jsonStr("name", str) + ", " ;
+  json.str("name", str) ;
+
+  json.num("total internal heap", heap_caps_get_total_size(MALLOC_CAP_INTERNAL))
+      .num("free internal heap", heap_caps_get_free_size(MALLOC_CAP_INTERNAL)) ;
+
+  json.num("total external heap", heap_caps_get_total_size(MALLOC_CAP_SPIRAM))
+      .num("free external heap", heap_caps_get_free_size(MALLOC_CAP_SPIRAM)) ;
 
-  json += jsonInt("total internal heap", heap_caps_get_total_size(MALLOC_CAP_INTERNAL)) + ", " ;
-  json += jsonInt("free internal heap", heap_caps_get_free_size(MALLOC_CAP_INTERNAL)) + ", " ;
+  json.num("tls handshakes", httpd.tlsHandshakes())
+      .num("tls resumes", httpd.tlsResumes()) ;
 
-  json += jsonInt("total external heap", heap_caps_get_total_size(MALLOC_CAP_SPIRAM)) + ", " ;
-  json += jsonInt("free external heap", heap_caps_get_free_size(MALLOC_CAP_SPIRAM)) + ", " ;
+  {
+    json.arr("streams") ;
+    for (const Camera::StreamStats &stats : camera.streamStats())
+    {
+      char buff[48] ;
+      snprintf(buff, sizeof(buff), "%u sent / %u dropped", stats._frames, stats._dropped) ;
+      json.str(nullptr, buff) ;
+    }
+    json.end() ;
+  }
 
   {
     size_t total, used ;
     if (spifs.df(total, used))
     {
-      json += jsonInt("total spifs", (uint32_t)total) + ", " ;
-      json += jsonInt("free spifs", (uint32_t)(total - used)) + ", " ;
+      json.num("total spifs", (uint32_t)total)
+          .num("free spifs", (uint32_t)(total - used)) ;
     }
     else
     {
-      json += jsonStr("spifs", "n/a") + ", " ;
+      json.str("spifs", "n/a") ;
     }
   }
   
@@ -43,62 +60,59 @@ std::string infoJson()
     uint8_t mac[6] ;
     if (esp_wifi_get_mac(WIFI_IF_AP, mac) == ESP_OK)
     {
-      json += jsonStr("ap mac", mac_to_s(mac)) + ", " ;
+      json.str("ap mac", mac_to_s(mac)) ;
       tcpip_adapter_ip_info_t ipInfo;
       tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_AP, &ipInfo);
-      json += jsonStr("ap ip", ip_to_s((uint8_t*)&ipInfo.ip.addr)) + ", " ;
+      json.str("ap ip", ip_to_s((uint8_t*)&ipInfo.ip.addr)) ;
     }
     else
-      json += jsonStr("ap", "n/a") + ", " ;
+      json.str("ap", "n/a") ;
   }
 
   {
     uint8_t mac[6] ;
     if (esp_wifi_get_mac(WIFI_IF_STA, mac) == ESP_OK)
     {
-      json += jsonStr("sta mac", mac_to_s(mac)) + ", " ;
+      json.str("sta mac", mac_to_s(mac)) ;
       tcpip_adapter_ip_info_t ipInfo;
       tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ipInfo);
-      json += jsonStr("sta ip", ip_to_s((uint8_t*)&ipInfo.ip.addr)) + ", " ;
+      json.str("sta ip", ip_to_s((uint8_t*)&ipInfo.ip.addr)) ;
     }
     else
-      json += jsonStr("sta", "n/a") + ", " ;
+      json.str("sta", "n/a") ;
   }
 
   // more info?
   // ssid, bssid, rssi, gw, netmask
   // freq, uptime, spifs
   
-  json += jsonStr("eot", "eot") ;
-
-  json += " }" ;
+  json.str("eot", "eot") ;
 
-  return json ;
+  json.end() ;
 }
 
 const HTTPD::FileInfo HTTPD::_staticUriCommon[]
   {
-   { "/favicon.ico"         , "image/x-icon"             , "camera-40.ico"       },
-   { "/camera.svg"          , "image/svg+xml"            , "camera.svg"          },
-   { "/camera-16.png"       , "image/png"                , "camera-16.png"       },
-   { "/camera-32.png"       , "image/png"                , "camera-32.png"       },
-   { "/camera-64.png"       , "image/png"                , "camera-64.png"       },
-   { "/esp32-cam-ota.html"  , "text/html"                , "esp32-cam-ota.html"  },
-   { "/esp32-cam-info.html" , "text/html"                , "esp32-cam-info.html" },
-   { "/esp32-cam.css"       , "text/css"                 , "esp32-cam.css"       },
-   { "/esp32-cam.js"        , "text/javascript"          , "esp32-cam.js"        },
-   { "/settings.txt"        , "text/plain;charset=utf-8" , "settings.txt"        },
+   { "/favicon.ico"         , "image/x-icon"             , "camera-40.ico"       , "max-age=86400" },
+   { "/camera.svg"          , "image/svg+xml"            , "camera.svg"          , "max-age=86400" },
+   { "/camera-16.png"       , "image/png"                , "camera-16.png"       , "max-age=86400" },
+   { "/camera-32.png"       , "image/png"                , "camera-32.png"       , "max-age=86400" },
+   { "/camera-64.png"       , "image/png"                , "camera-64.png"       , "max-age=86400" },
+   { "/esp32-cam-ota.html"  , "text/html"                , "esp32-cam-ota.html"  , "no-cache"      },
+   { "/esp32-cam-info.html" , "text/html"                , "esp32-cam-info.html" , "no-cache"      },
+   { "/esp32-cam.css"       , "text/css"                 , "esp32-cam.css"       , "no-cache"      },
+   { "/esp32-cam.js"        , "text/javascript"          , "esp32-cam.js"        , "no-cache"      },
   } ;
 
 const HTTPD::FileInfo HTTPD::_staticUriSetup[]
   {
-   { "/esp32-cam.html"      , "text/html"                , "esp32-cam-setup.html"},
+   { "/esp32-cam.html"      , "text/html"                , "esp32-cam-setup.html", "no-cache"      },
   } ;
 
 const HTTPD::FileInfo HTTPD::_staticUriRunning[]
   {
-   { "/esp32-cam.html"      , "text/html"                , "esp32-cam.html"      },
-   { "/esp32-cam-setup.html", "text/html"                , "esp32-cam-setup.html"},
+   { "/esp32-cam.html"      , "text/html"                , "esp32-cam.html"      , "no-cache"      },
+   { "/esp32-cam-setup.html", "text/html"                , "esp32-cam-setup.html", "no-cache"      },
   } ;
 
 const httpd_uri_t HTTPD::_dynamicUriCommon[] =
@@ -127,14 +141,52 @@ const httpd_uri_t HTTPD::_dynamicUriCommon[] =
     wifiSetup,
     nullptr
    },
+   {
+    "/ota-pull",
+    HTTP_GET,
+    pull,
+    nullptr
+   },
+   {
+    "/ota-pull",
+    HTTP_POST,
+    pull,
+    nullptr
+   },
+   {
+    "/metrics",
+    HTTP_GET,
+    [](httpd_req_t *req)
+    {
+      httpd_resp_set_type(req, "text/plain; version=0.0.4") ;
+      std::string text = metrics.text() ;
+      return httpd_resp_send(req, text.data(), text.size()) ;
+    },
+    nullptr
+   },
+   {
+    "/events",
+    HTTP_GET,
+    [](httpd_req_t *req)
+    {
+      // the events task sends to all subscribers, the handler returns right away
+      if (!events.subscribe(req))
+      {
+        httpd_resp_set_status(req, "503 Service Unavailable") ;
+        httpd_resp_sendstr(req, "events not available") ;
+      }
+      return ESP_OK ;
+    },
+    nullptr
+   },
    {
     "/info.json",
     HTTP_GET,
     [](httpd_req_t *req)
     {
-      httpd_resp_set_type(req, "application/json") ;
-      std::string json = infoJson() ;
-      return httpd_resp_send(req, json.data(), json.size()) ;
+      JsonWriter json(req) ;
+      infoJson(json) ;
+      return json.finish() ? ESP_OK : ESP_FAIL ;
     },
     nullptr
    }
@@ -147,16 +199,16 @@ const httpd_uri_t HTTPD::_dynamicUriRunning[] =
     HTTP_GET,
     [](httpd_req_t *req)
     {
-      Data data ;
-      if (!camera.capture(data))
+      Frame frame ;
+      if (!camera.capture(frame))
       {
-        ESP_LOGE("Camera", "caputure failed") ;
+        ESP_LOGE("Camera", "capture failed") ;
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "camera capture failed") ;
         return ESP_OK ;
       }
          
       httpd_resp_set_type(req, "image/jpeg") ;
-      httpd_resp_send(req, (const char*) data.data(), data.size()) ;
+      httpd_resp_send(req, (const char*) frame->buf, frame->len) ;
 
       return ESP_OK ;
     },
@@ -167,55 +219,94 @@ const httpd_uri_t HTTPD::_dynamicUriRunning[] =
     HTTP_GET,
     [](httpd_req_t *req)
     {
-      static std::string nl{"\r\n"} ;
-      static std::string boundaryDef{"esp32camstreampart"} ;
-      static std::string boundary{"--" + boundaryDef + nl} ;
-      static std::string contentTypeDef{"multipart/x-mixed-replace; boundary=" + boundaryDef} ;
-      static std::string contentType{"Content-Type: image/jpeg" + nl} ;
-
-      esp_err_t res ;
-      ESP_LOGD("Camera", "%s", contentTypeDef.c_str()) ;
-      if ((res = httpd_resp_set_type(req, contentTypeDef.c_str())) != ESP_OK)
-        return res ;
-
-      ESP_LOGD("Camera", "%s", boundary.c_str()) ;
-      if ((res = httpd_resp_send_chunk(req, boundary.data(), boundary.size())) != ESP_OK)
-        return res ;
-
-      while (true) // send images
+      uint8_t fps{5} ;
       {
-        Data data ;
-        if (!camera.capture(data))
-        {
-          ESP_LOGE("Camera", "caputure failed") ;
-          return ESP_FAIL ;
-        }
-            
-        char length[32] ;
-        snprintf(length, sizeof(length), "%zd", data.size()) ;
-            
-        std::string str ;
-        str += contentType ;
-        str += "Content-Length: " + std::string(length) + nl ;
-        str += nl ;
-        ESP_LOGD("Camera", "%s", str.c_str()) ;
-        if (((res = httpd_resp_send_chunk(req, str.data(), str.size())) != ESP_OK) ||
-            ((res = httpd_resp_send_chunk(req, (const char*) data.data(), data.size())) != ESP_OK) ||
-            ((res = httpd_resp_send_chunk(req, boundary.data(), boundary.size())) != ESP_OK))
-          return res ;
-
-        vTaskDelay(1000 / portTICK_PERIOD_MS) ;
+        char query[64] ;
+        char value[8] ;
+        int16_t i ;
+        if ((httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) &&
+            (httpd_query_key_value(query, "fps", value, sizeof(value)) == ESP_OK) &&
+            to_i(value, i) && (1 <= i) && (i <= 30))
+          fps = i ;
       }
+
+      // the stream runs in a stream worker, the httpd task stays free
+      if (!streamPool.start(req, new MjpegSession(req, fps)))
+      {
+        httpd_resp_set_status(req, "503 Service Unavailable") ;
+        httpd_resp_sendstr(req, "too many streams") ;
+      }
+      return ESP_OK ;
     },
     nullptr
    },
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+   {
+    "/ws/stream",
+    HTTP_GET,
+    [](httpd_req_t *req)
+    {
+      if (req->method == HTTP_GET) // handshake done
+      {
+        if (!streamPool.start(req, new WsSession(req)))
+          return ESP_FAIL ;
+        return ESP_OK ;
+      }
+
+      // control message "key=value"
+      char buff[64] ;
+      httpd_ws_frame_t pkt{} ;
+      if (httpd_ws_recv_frame(req, &pkt, 0) != ESP_OK)
+        return ESP_FAIL ;
+      if (pkt.len >= sizeof(buff))
+        return ESP_FAIL ;
+      pkt.payload = (uint8_t*) buff ;
+      if (httpd_ws_recv_frame(req, &pkt, pkt.len) != ESP_OK)
+        return ESP_FAIL ;
+      if (pkt.type != HTTPD_WS_TYPE_TEXT)
+        return ESP_OK ;
+      buff[pkt.len] = 0 ;
+
+      WsSession *session = (WsSession*)(StreamSession*) req->sess_ctx ;
+      char *ch = strchr(buff, '=') ;
+      if (!session || !ch || !session->control(std::string(buff, ch - buff), std::string(ch+1)))
+        ESP_LOGW("Httpd", "/ws/stream invalid message %s", buff) ;
+      return ESP_OK ;
+    },
+    nullptr,
+    true
+   },
+#endif
    {
     "/settings.json",
     HTTP_GET,
     [](httpd_req_t *req)
     {
+      httpd_resp_set_hdr(req, "ETag", publicSettings.etag()) ;
+      httpd_resp_set_hdr(req, "Cache-Control", "no-cache") ;
+
+      // ?since=<boot>-<version> (the etag) - only the settings changed after that version,
+      // all of them if the token is bad or from before a reboot
+      char query[48] ;
+      char value[24] ;
+      if ((httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) &&
+          (httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK))
+      {
+        // rendered first, the settings stay locked while the json is written
+        std::string delta ;
+        delta.reserve(256) ;
+        JsonWriter json(delta) ;
+        publicSettings.json(json, publicSettings.since(value)) ;
+        json.finish() ;
+        httpd_resp_set_type(req, "application/json") ;
+        return httpd_resp_send(req, delta.data(), delta.size()) ;
+      }
+
+      if (notModified(req, publicSettings.etag()))
+        return ESP_OK ;
+
+      const std::string &json = publicSettings.json() ;
       httpd_resp_set_type(req, "application/json") ;
-      std::string json = publicSettings.json() ;
       return httpd_resp_send(req, json.data(), json.size()) ;
     },
     nullptr
@@ -270,28 +361,37 @@ const httpd_uri_t HTTPD::_dynamicUriRunning[] =
         return ESP_OK ;      
       }
 
-      char *ch ;
       if (((size+1) > sizeof(buff)) ||
-          (httpd_req_get_url_query_str(req, buff, size+1) != ESP_OK) ||
-          ((ch = strchr(buff, '=')) == nullptr))
+          (httpd_req_get_url_query_str(req, buff, size+1) != ESP_OK))
       {
         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid parameters") ;
         return ESP_OK ;
       }
-          
-      std::string key(buff, (ch) - buff) ;
-      std::string val(ch+1, (buff+size) - (ch+1)) ;
-
-      ESP_LOGD("Httpd", "%s", ("- " + key + " " + val).c_str()) ;
-      
-      if (!publicSettings.set(key, val))
+      return set(req, buff, size) ;
+    },
+    nullptr
+   },
+   {
+    "/set",
+    HTTP_POST,
+    [](httpd_req_t *req)
+    {
+      ESP_LOGD("Httpd", "/set") ;
+      char buff[1024] ;
+      size_t size = req->content_len ;
+      if (size >= sizeof(buff))
       {
         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid parameters") ;
         return ESP_OK ;
       }
-      
-      httpd_resp_send(req, nullptr, 0) ;
-      return ESP_OK ;      
+      for (size_t recvSize = 0 ; recvSize < size ; )
+      {
+        int n = httpd_req_recv(req, buff + recvSize, size - recvSize) ;
+        if (n <= 0)
+          return ESP_FAIL ;
+        recvSize += n ;
+      }
+      return set(req, buff, size) ;
     },
     nullptr
    },
@@ -307,7 +407,22 @@ bool HTTPD::start()
   ESP_LOGD("Httpd", "start()") ;
   httpd_ssl_config_t cfg = HTTPD_SSL_CONFIG_DEFAULT() ;
 
-  cfg.httpd.max_uri_handlers = 24 ;
+  cfg.httpd.max_uri_handlers = 32 ;
+
+  // a socket per stream worker and one for /events stay open, plus the page, its
+  // parallel requests and /set; httpd keeps 3 of the lwip sockets for itself
+  std::string workers ;
+  int16_t streamWorkers ;
+  if (!publicSettings.get("esp.stream-workers", workers) || !to_i(workers, streamWorkers))
+    streamWorkers = 2 ;
+  cfg.httpd.max_open_sockets = std::min(streamWorkers + 1 + 3, CONFIG_LWIP_MAX_SOCKETS - 3) ;
+  cfg.httpd.lru_purge_enable = true ; // the streams touch() their sockets, idle ones go first
+
+  // mode() runs on the event task, the metrics map must not change once requests are timed
+  for (const auto &uri : _dynamicUriCommon)
+    metrics.uri(uri.uri) ;
+  for (const auto &uri : _dynamicUriRunning)
+    metrics.uri(uri.uri) ;
   
   if (!spifs.read("cert.der", _certPem)) // pem does not work - use der
   {
@@ -325,6 +440,18 @@ bool HTTPD::start()
   cfg.prvtkey_pem = (const uint8_t*) _keyPem.data() ;
   cfg.prvtkey_len = _keyPem.size() ;
 
+  std::string tlsTickets ;
+  publicSettings.get("esp.tls-tickets", tlsTickets) ;
+#ifdef CONFIG_ESP_TLS_SERVER_SESSION_TICKETS
+  cfg.session_tickets = (tlsTickets == "on") ;
+#else
+  if (tlsTickets == "on")
+    ESP_LOGW("Httpd", "tls session tickets not supported (CONFIG_ESP_TLS_SERVER_SESSION_TICKETS)") ;
+#endif
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+  cfg.user_cb = tlsSession ;
+#endif
+
   //cfg.transport_mode = HTTPD_SSL_TRANSPORT_INSECURE ; 
   
   if (httpd_ssl_start(&_httpd, &cfg) != ESP_OK)
@@ -333,6 +460,16 @@ bool HTTPD::start()
     return false ;
   }
 
+  {
+    std::string core ;
+    publicSettings.get("esp.stream-core", core) ;
+    if (!streamPool.init(streamWorkers, (core == "0") ? 0 : (core == "1") ? 1 : tskNO_AFFINITY))
+      return false ;
+  }
+
+  if (!events.init())
+    return false ;
+
   for (const FileInfo &fi : _staticUriCommon)
   {
     httpd_uri_t uri ;
@@ -348,11 +485,8 @@ bool HTTPD::start()
   }
 
   for (const auto &uri : _dynamicUriCommon)
-    if (httpd_register_uri_handler(_httpd, &uri) != ESP_OK)
-    {
-      ESP_LOGW("Httpd", "httpd_register_uri_handler() failed %s", uri.uri) ;
+    if (!registerTimed(uri))
       return false ;
-    }
   
   if (!mode(Mode::setup))
     return false ;
@@ -443,11 +577,8 @@ bool HTTPD::mode(HTTPD::Mode mode)
     }
   
     for (const auto &uri : _dynamicUriRunning)
-      if (httpd_register_uri_handler(_httpd, &uri) != ESP_OK)
-      {
-        ESP_LOGW("Httpd", "httpd_register_uri_handler() failed %s", uri.uri) ;
+      if (!registerTimed(uri))
         result = false ;
-      }
     break ;
   }
 
@@ -467,21 +598,166 @@ bool HTTPD::stop()
   return true ;
 }
 
-esp_err_t HTTPD::getFile(httpd_req_t *req)
+bool HTTPD::registerTimed(const httpd_uri_t &uri)
 {
-  Data data ;
+  // handler runs through timed() for the per uri metrics
+  httpd_uri_t timedUri = uri ;
+  timedUri.handler = HTTPD::timed ;
+  timedUri.user_ctx = (void*)&uri ;
+  if (httpd_register_uri_handler(_httpd, &timedUri) != ESP_OK)
+  {
+    ESP_LOGW("Httpd", "httpd_register_uri_handler() failed %s", uri.uri) ;
+    return false ;
+  }
+  return true ;
+}
 
+esp_err_t HTTPD::timed(httpd_req_t *req)
+{
+  const httpd_uri_t &uri = *(const httpd_uri_t*) req->user_ctx ;
+  int64_t begin = esp_timer_get_time() ;
+  esp_err_t res = uri.handler(req) ;
+  metrics.request(uri.uri, esp_timer_get_time() - begin) ;
+  return res ;
+}
+
+static std::atomic<uint32_t> tlsResumeCount{0} ;
+
+#ifdef CONFIG_ESP_TLS_SERVER_SESSION_TICKETS
+// linked with --wrap=mbedtls_ssl_ticket_parse (src/CMakeLists.txt), the server
+// keeps no session cache, so a ticket that parses is a resumed handshake
+extern "C" int __real_mbedtls_ssl_ticket_parse(void *p_ticket, mbedtls_ssl_session *session, unsigned char *buf, size_t len) ;
+
+extern "C" int __wrap_mbedtls_ssl_ticket_parse(void *p_ticket, mbedtls_ssl_session *session, unsigned char *buf, size_t len)
+{
+  int res = __real_mbedtls_ssl_ticket_parse(p_ticket, session, buf, len) ;
+  if (res == 0)
+    ++tlsResumeCount ;
+  return res ;
+}
+#endif
+
+// linked with --wrap=esp_tls_server_session_create, called by the https server
+// on the httpd task right after the accept, the handshake ends with user_cb
+static int64_t handshakeBegin{0} ;
+
+extern "C" int __real_esp_tls_server_session_create(esp_tls_cfg_server_t *cfg, int sockfd, esp_tls_t *tls) ;
+
+extern "C" int __wrap_esp_tls_server_session_create(esp_tls_cfg_server_t *cfg, int sockfd, esp_tls_t *tls)
+{
+  handshakeBegin = esp_timer_get_time() ;
+  return __real_esp_tls_server_session_create(cfg, sockfd, tls) ;
+}
+
+uint32_t HTTPD::tlsHandshakes() const { return _tlsHandshakes ; }
+uint32_t HTTPD::tlsResumes() const { return tlsResumeCount ; }
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+void HTTPD::tlsSession(esp_https_server_user_cb_arg_t *arg)
+{
+  ++httpd._tlsHandshakes ;
+  metrics.tlsHandshake(esp_timer_get_time() - handshakeBegin) ;
+}
+#endif
+
+esp_err_t HTTPD::getFile(httpd_req_t *req)
+{
   const FileInfo &fi = *((const FileInfo*)req->user_ctx) ;
-  
-  if (!spifs.read(fi._file, data))
+
+  // web ui compiled into the firmware
+  const Asset *a = asset(fi._file) ;
+  if (a)
   {
-    ESP_LOGW("Httpd", "read file failed %s", fi._file) ;
-    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "file not found") ;
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding") ;
+
+    char acceptEncoding[64] ;
+    size_t acceptEncodingSize{httpd_req_get_hdr_value_len(req, "Accept-Encoding")} ;
+    if (a->_gzip && acceptEncodingSize && (acceptEncodingSize < sizeof(acceptEncoding)) &&
+        (httpd_req_get_hdr_value_str(req, "Accept-Encoding", acceptEncoding, sizeof(acceptEncoding)) == ESP_OK) &&
+        strstr(acceptEncoding, "gzip"))
+    {
+      httpd_resp_set_hdr(req, "Content-Encoding", "gzip") ;
+      return sendFile(req, fi, a->_gzip, a->_gzipSize, a->_gzipEtag) ;
+    }
+    return sendFile(req, fi, a->_data, a->_size, a->_etag) ;
+  }
+
+  ESP_LOGW("Httpd", "no asset %s", fi._file) ;
+  httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "file not found") ;
+  return ESP_OK ;
+}
+
+esp_err_t HTTPD::set(httpd_req_t *req, const char *buff, size_t size)
+{
+  // key=value pairs separated by '&' or new lines
+  Settings::Pairs pairs ;
+  const char *end = buff + size ;
+  for (const char *k = buff ; k < end ; )
+  {
+    const char *e = std::find_if(k, end, [](char ch) { return (ch == '&') || (ch == '\n') ; }) ;
+    const char *v = std::find(k, e, '=') ;
+    if (v == e)
+    {
+      if (std::find_if(k, e, [](char ch) { return !isspace(ch) ; }) != e)
+      {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid parameters") ;
+        return ESP_OK ;
+      }
+    }
+    else
+    {
+      const char *ve = ((e > v+1) && (e[-1] == '\r')) ? e-1 : e ;
+      ESP_LOGD("Httpd", "- %.*s %.*s", (int)(v-k), k, (int)(ve-(v+1)), v+1) ;
+      pairs.emplace_back(std::string(k, v-k), std::string(v+1, ve-(v+1))) ;
+    }
+    k = e + 1 ;
+  }
+
+  // the framesize change resets the sensor window, it goes last
+  std::stable_partition(pairs.begin(), pairs.end(),
+                        [](const std::pair<std::string, std::string> &pair) { return pair.first != "camera.framesize" ; }) ;
+
+  bool result ;
+  if (!camera.apply([&pairs]{ return publicSettings.set(pairs) ; }, result))
+  {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "camera busy") ;
+    return ESP_OK ;
+  }
+  if (!result)
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid parameters") ;
     return ESP_OK ;
   }
+      
+  httpd_resp_send(req, nullptr, 0) ;
+  return ESP_OK ;
+}
+
+bool HTTPD::notModified(httpd_req_t *req, const char *etag)
+{
+  char ifNoneMatch[128] ;
+  size_t ifNoneMatchSize{httpd_req_get_hdr_value_len(req, "If-None-Match")} ;
+  if (ifNoneMatchSize && (ifNoneMatchSize < sizeof(ifNoneMatch)) &&
+      (httpd_req_get_hdr_value_str(req, "If-None-Match", ifNoneMatch, sizeof(ifNoneMatch)) == ESP_OK) &&
+      (strstr(ifNoneMatch, etag) || !strcmp(ifNoneMatch, "*")))
+  {
+    httpd_resp_set_status(req, "304 Not Modified") ;
+    httpd_resp_send(req, nullptr, 0) ;
+    return true ;
+  }
+  return false ;
+}
+
+esp_err_t HTTPD::sendFile(httpd_req_t *req, const FileInfo &fi, const uint8_t *data, size_t size, const char *etag)
+{
+  httpd_resp_set_hdr(req, "ETag", etag) ;
+  httpd_resp_set_hdr(req, "Cache-Control", fi._cacheControl) ;
+
+  if (notModified(req, etag))
+    return ESP_OK ;
 
   httpd_resp_set_type(req, fi._type);
-  httpd_resp_send(req, (const char*) data.data(), data.size()) ;
+  httpd_resp_send(req, (const char*) data, size) ;
 
   return ESP_OK ;
 }
@@ -0,0 +1,94 @@
+////////////////////////////////////////////////////////////////////////////////
+// memmem.hpp
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// substring search for MultiPart, header only so tools/memmem-bench.cpp can
+// build it on the host
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+
+// first c in [b, e), tests 32 bit words for a zero byte of word ^ c
+// loads are aligned, xtensa does not do unaligned 32 bit loads
+inline const uint8_t* memchrWord(const uint8_t *b, const uint8_t *e, uint8_t c)
+{
+  for ( ; (b < e) && ((uintptr_t)b & 3) ; ++b)
+    if (*b == c)
+      return b ;
+
+  const uint32_t ones  = 0x01010101 ;
+  const uint32_t highs = 0x80808080 ;
+  const uint32_t mask  = c * ones ;
+  for ( ; (e - b) >= 4 ; b += 4)
+  {
+    uint32_t v ;
+    memcpy(&v, b, 4) ;
+    v ^= mask ;
+    if ((v - ones) & ~v & highs)
+      break ;
+  }
+
+  for ( ; b < e ; ++b)
+    if (*b == c)
+      return b ;
+  return nullptr ;
+}
+
+// short or one off patterns: word probe for the first byte, then memcmp
+inline const uint8_t* memmem(const uint8_t *buff, size_t size, const uint8_t *pattern, size_t patternSize)
+{
+  if (!patternSize || !buff || (patternSize > size))
+    return nullptr ;
+  const uint8_t *e = buff + size - patternSize + 1 ;
+  for (const uint8_t *b = buff ; (b = memchrWord(b, e, pattern[0])) ; ++b)
+    if (!memcmp(b+1, pattern+1, patternSize-1))
+      return b ;
+  return nullptr ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+class Horspool // Boyer-Moore-Horspool, the skip table is built once per pattern
+{
+public:
+  // pattern is not copied, shorter patterns than 4 bytes use memmem()
+  Horspool(const uint8_t *pattern, size_t size) : _pattern{pattern}, _size{size}
+  {
+    size_t skip = (size && (size < 256)) ? size : 255 ;
+    memset(_skip, (int)skip, sizeof(_skip)) ;
+    for (size_t i = 0 ; (i+1) < size ; ++i)
+      _skip[pattern[i]] = (uint8_t) std::min<size_t>(size-1 - i, skip) ;
+  }
+
+  const uint8_t* find(const uint8_t *buff, size_t size) const
+  {
+    if (_size < 4)
+      return memmem(buff, size, _pattern, _size) ;
+    if (!buff || (_size > size))
+      return nullptr ;
+
+    const uint8_t last = _pattern[_size-1] ;
+    for (size_t i = 0, e = size - _size ; i <= e ; i += _skip[buff[i + _size-1]])
+    {
+      if ((buff[i + _size-1] == last) &&
+          !memcmp(buff + i, _pattern, _size-1))
+        return buff + i ;
+    }
+    return nullptr ;
+  }
+
+private:
+  const uint8_t *_pattern ;
+  size_t         _size ;
+  uint8_t        _skip[256] ; // shift by the window's last byte
+} ;
+
+////////////////////////////////////////////////////////////////////////////////
+// EOF
+////////////////////////////////////////////////////////////////////////////////
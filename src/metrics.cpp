@@ -0,0 +1,159 @@
+////////////////////////////////////////////////////////////////////////////////
+// metrics.cpp
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdarg>
+#include "esp32-cam.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+
+Metrics metrics ;
+
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr uint32_t Histogram::_bounds[] ;
+
+static void line(std::string &text, const char *format, ...)
+{
+  char buff[160] ;
+  va_list args ;
+  va_start(args, format) ;
+  vsnprintf(buff, sizeof(buff), format, args) ;
+  va_end(args) ;
+  text += buff ;
+}
+
+void Histogram::observe(int64_t us)
+{
+  size_t i = 0 ;
+  while ((i < _size) && (us > (int64_t)_bounds[i] * 1000))
+    ++i ;
+  ++_buckets[i] ;
+  _sum += us ;
+}
+
+uint32_t Histogram::count() const
+{
+  uint32_t count{0} ;
+  for (const auto &bucket : _buckets)
+    count += bucket ;
+  return count ;
+}
+
+uint64_t Histogram::sum() const
+{
+  return _sum ;
+}
+
+void Histogram::text(std::string &text, const char *name, const char *labels) const
+{
+  const char *sep = *labels ? "," : "" ;
+  uint32_t count{0} ;
+  for (size_t i = 0 ; i < _size ; ++i)
+  {
+    count += _buckets[i] ;
+    line(text, "%s_bucket{%s%sle=\"%u.%03u\"} %u\n", name, labels, sep, _bounds[i] / 1000, _bounds[i] % 1000, count) ;
+  }
+  count += _buckets[_size] ;
+  line(text, "%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, sep, count) ;
+  uint64_t sum = _sum ;
+  line(text, "%s_sum{%s} %u.%06u\n", name, labels, (uint32_t)(sum / 1000000), (uint32_t)(sum % 1000000)) ;
+  line(text, "%s_count{%s} %u\n", name, labels, count) ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Metrics::capture(bool ok, int64_t us)
+{
+  if (ok)
+    _capture.observe(us) ;
+  else
+    ++_captureFailed ;
+}
+
+void Metrics::grab(bool ok, int64_t us)
+{
+  if (ok)
+    _grab.observe(us) ;
+  else
+    ++_grabFailed ;
+}
+
+void Metrics::tlsHandshake(int64_t us)
+{
+  _tlsHandshake.observe(us) ;
+}
+
+void Metrics::uri(const char *uri)
+{
+  _requests[uri] ; // before the server starts, request() and text() only read the map
+}
+
+void Metrics::request(const char *uri, int64_t us)
+{
+  auto iRequest = _requests.find(uri) ;
+  if (iRequest != _requests.end())
+    iRequest->second.observe(us) ;
+}
+
+std::string Metrics::text()
+{
+  std::string text ;
+  text.reserve(4096) ;
+
+  text += "# TYPE esp32cam_capture_seconds histogram\n" ;
+  _capture.text(text, "esp32cam_capture_seconds", "") ;
+  text += "# TYPE esp32cam_capture_failed_total counter\n" ;
+  line(text, "esp32cam_capture_failed_total %u\n", (uint32_t)_captureFailed) ;
+
+  text += "# TYPE esp32cam_grab_seconds histogram\n" ;
+  _grab.text(text, "esp32cam_grab_seconds", "") ;
+  text += "# TYPE esp32cam_grab_failed_total counter\n" ;
+  line(text, "esp32cam_grab_failed_total %u\n", (uint32_t)_grabFailed) ;
+
+  text += "# TYPE esp32cam_http_request_seconds histogram\n" ;
+  for (const auto &request : _requests)
+  {
+    char labels[80] ;
+    snprintf(labels, sizeof(labels), "uri=\"%s\"", request.first.c_str()) ;
+    request.second.text(text, "esp32cam_http_request_seconds", labels) ;
+  }
+
+  text += "# TYPE esp32cam_tls_handshakes_total counter\n" ;
+  line(text, "esp32cam_tls_handshakes_total %u\n", httpd.tlsHandshakes()) ;
+  text += "# TYPE esp32cam_tls_resumes_total counter\n" ;
+  line(text, "esp32cam_tls_resumes_total %u\n", httpd.tlsResumes()) ;
+  text += "# TYPE esp32cam_tls_handshake_seconds histogram\n" ;
+  _tlsHandshake.text(text, "esp32cam_tls_handshake_seconds", "") ;
+
+  Camera::StreamStats totals = camera.streamTotals() ;
+  text += "# TYPE esp32cam_stream_frames_total counter\n" ;
+  line(text, "esp32cam_stream_frames_total %u\n", totals._frames) ;
+  text += "# TYPE esp32cam_stream_dropped_total counter\n" ;
+  line(text, "esp32cam_stream_dropped_total %u\n", totals._dropped) ;
+  text += "# TYPE esp32cam_stream_bytes_total counter\n" ;
+  line(text, "esp32cam_stream_bytes_total %llu\n", (unsigned long long) totals._bytes) ;
+
+  std::vector<Camera::StreamStats> streams = camera.streamStats() ;
+  text += "# TYPE esp32cam_streams gauge\n" ;
+  line(text, "esp32cam_streams %u\n", (uint32_t) streams.size()) ;
+  text += "# TYPE esp32cam_stream_bytes gauge\n" ;
+  for (size_t i = 0 ; i < streams.size() ; ++i)
+    line(text, "esp32cam_stream_bytes{stream=\"%u\"} %llu\n", streams[i]._id, (unsigned long long) streams[i]._bytes) ;
+  text += "# TYPE esp32cam_stream_dropped gauge\n" ;
+  for (size_t i = 0 ; i < streams.size() ; ++i)
+    line(text, "esp32cam_stream_dropped{stream=\"%u\"} %u\n", streams[i]._id, streams[i]._dropped) ;
+
+  text += "# TYPE esp32cam_heap_free_bytes gauge\n" ;
+  line(text, "esp32cam_heap_free_bytes{heap=\"internal\"} %u\n", heap_caps_get_free_size(MALLOC_CAP_INTERNAL)) ;
+  line(text, "esp32cam_heap_free_bytes{heap=\"psram\"} %u\n", heap_caps_get_free_size(MALLOC_CAP_SPIRAM)) ;
+  text += "# TYPE esp32cam_heap_min_free_bytes gauge\n" ;
+  line(text, "esp32cam_heap_min_free_bytes{heap=\"internal\"} %u\n", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL)) ;
+  line(text, "esp32cam_heap_min_free_bytes{heap=\"psram\"} %u\n", heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM)) ;
+
+  return text ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// EOF
+////////////////////////////////////////////////////////////////////////////////
@@ -6,47 +6,16 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
-MultiPart::Part::Part() :
-  _headBegin{nullptr}, _headEnd{nullptr}, _bodyBegin{nullptr}, _bodyEnd{nullptr}
-{}
-MultiPart::Part::Part(const uint8_t *hb, const uint8_t *he, const uint8_t *bb, const uint8_t *be) :
-  _headBegin{hb}, _headEnd{he}, _bodyBegin{bb}, _bodyEnd{be}
-{}
-
-uint32_t MultiPart::Part::headSize() const
-{
-  return _headEnd - _headBegin ;
-}
-uint32_t MultiPart::Part::bodySize() const
-{
-  return _bodyEnd - _bodyBegin ;
-}
-
-const uint8_t* memmem(const uint8_t *buff, size_t size, const uint8_t *pattern, size_t patternSize)
-{
-  if (!patternSize || !buff || (patternSize > size))
-    return nullptr ;
-  uint8_t first = pattern[0] ;
-  for (const uint8_t *b = buff, *e = buff+size-patternSize ; b <= e ; ++b)
-  {
-    if ((*b == first) &&
-        !memcmp(b, pattern, patternSize))
-      return b ;
-  }
-  return nullptr ;
-}
-
-MultiPart::MultiPart(httpd_req_t *req) : _req{req}, _content{nullptr}
+MultiPart::MultiPart(httpd_req_t *req) : _req{req}, _buff{(uint8_t*) malloc(_buffSize)}
 {
 }
 
 MultiPart::~MultiPart()
 {
-  if (_content)
-    free(_content) ;
+  if (_buff)
+    free(_buff) ;
 }
 
-
 bool MultiPart::parseName(const uint8_t *head, size_t headSize, std::string &name)
 {
   uint8_t nl[2] = { 13, 10 } ;
@@ -90,77 +59,8 @@ bool MultiPart::parseName(const uint8_t *head, size_t headSize, std::string &nam
   return true ;
 }
 
-bool MultiPart::parseBody(const uint8_t *boundary, size_t boundarySize,
-                          const uint8_t *data, size_t dataSize)
+bool MultiPart::header(char *boundary, size_t boundaryMax, size_t &boundarySize)
 {
-  uint8_t nl[4] = { 13, 10, 13, 10 } ;
-  
-  if (dataSize < boundarySize)
-    return false ;
-  if (memcmp(data, boundary+2, boundarySize-2))
-    return false ;
-
-  data += boundarySize - 2 ;
-  dataSize -= boundarySize - 2 ;
-  
-  while (true)
-  {
-    if (dataSize < 2)
-      return false ;
-    if (!memcmp(data, "--", 2)) // end of multipart
-      return true ;
-    if (memcmp(data, nl, 2)) // end of boundary
-      return false ;
-
-    data += 2 ;
-    dataSize -= 2 ;
-    
-    uint8_t *eot = (uint8_t*) memmem(data, dataSize, boundary, boundarySize) ;
-    if (!eot)
-      return false ;
-    size_t tSize = eot - data ;
-    
-    uint8_t *eoh = (uint8_t*) memmem(data, tSize, nl, 4) ;
-    if (!eoh)
-      return false ;
-
-    std::string name ;
-    if (!parseName(data, eoh+2 - data, name))
-      return false ;
-
-    _parts.insert(std::pair<std::string, Part>(name, Part(data, eoh+2, eoh+4, eot))) ;
-
-    data += tSize + boundarySize ;
-    dataSize -= tSize + boundarySize ;
-  }
-}
-
-bool MultiPart::parse()
-{
-  char contentLength[32] ;
-  size_t contentLengthSize{httpd_req_get_hdr_value_len(_req, "Content-Length")} ;
-
-  if (!contentLengthSize)
-  {
-    httpd_resp_sendstr(_req, "HTTP header \"Content-Length\": not found") ;
-    return false ;
-  }
-  if (contentLengthSize > sizeof(contentLength))
-  {
-    httpd_resp_sendstr(_req, "HTTP header \"Content-Length\": too big") ;
-    return false ;
-  }
-  httpd_req_get_hdr_value_str(_req, "Content-Length", contentLength, sizeof(contentLength)) ;
-  
-  size_t contentSize = strtoul(contentLength, nullptr, 10) ;
-
-  uint8_t *_content = (uint8_t*) malloc(contentSize) ;
-  if (!_content)
-  {
-    httpd_resp_sendstr(_req, "HTTP header \"Content-Length\": too big") ;
-    return false ;
-  }
-  
   char contentType[256] ;
   size_t contentTypeSize{httpd_req_get_hdr_value_len(_req, "Content-Type")} ;
   
@@ -177,7 +77,6 @@ bool MultiPart::parse()
   httpd_req_get_hdr_value_str(_req, "Content-Type", contentType, sizeof(contentType)) ;
 
   // Content-Type: multipart/form-data; boundary=---------------------------XXXXXX
-  char boundary[64] = { 13, 10, '-', '-' } ;
   if (!strstr(contentType, "multipart/form-data"))
   {
     httpd_resp_sendstr(_req, "HTTP header \"Content-Type\": \"multipart/form-data\" not found") ;
@@ -193,50 +92,170 @@ bool MultiPart::parse()
   char *boundaryEnd = strchr(boundaryBegin, ';') ;
   if (!boundaryEnd)
     boundaryEnd = boundaryBegin + strlen(boundaryBegin) ;
-  size_t boundarySize = boundaryEnd - boundaryBegin ;
-  if (boundarySize >= (sizeof(boundary)-4))
+  boundarySize = boundaryEnd - boundaryBegin ;
+  if (boundarySize >= (boundaryMax-4))
   {
     httpd_resp_sendstr(_req, "HTTP header \"Content-Type\": \"boundary\" too big") ;
     return false ;
   }
 
+  // delimiter is CRLF "--" boundary
+  boundary[0] = 13 ;
+  boundary[1] = 10 ;
+  boundary[2] = '-' ;
+  boundary[3] = '-' ;
   memcpy(boundary+4, boundaryBegin, boundarySize) ;
-  boundary[boundarySize+4] = 0 ;
+  boundarySize += 4 ;
+  boundary[boundarySize] = 0 ;
+  return true ;
+}
+
+bool MultiPart::parse(const BeginFn &beginFn, const DataFn &dataFn, const EndFn &endFn)
+{
+  char boundary[64] ;
+  size_t boundarySize ;
+  if (!header(boundary, sizeof(boundary), boundarySize))
+    return false ;
+  const Horspool delimiter((const uint8_t*) boundary, boundarySize) ;
+  const uint8_t nl[4] = { 13, 10, 13, 10 } ;
+
+  if (!_buff)
+  {
+    httpd_resp_sendstr(_req, "Content: out of memory") ;
+    return false ;
+  }
+
+  // the first delimiter has no leading CRLF, pretend it had one
+  _buff[0] = 13 ;
+  _buff[1] = 10 ;
+  size_t size{2} ;
+  size_t remaining{_req->content_len} ;
+  State state{State::Preamble} ;
 
-  size_t recvSize{0} ;
-  while (recvSize != contentSize)
+  while (state != State::Done)
   {
-    int n =  httpd_req_recv(_req, (char*)_content + recvSize, contentSize - recvSize);
-    if (!n)
+    if (remaining && (size < _buffSize))
     {
-      httpd_resp_sendstr(_req, "Content: too small") ;
-      return false ;
+      int n = httpd_req_recv(_req, (char*)_buff + size, std::min(_buffSize - size, remaining)) ;
+      if (n == HTTPD_SOCK_ERR_TIMEOUT)
+        continue ;
+      if (n <= 0)
+      {
+        httpd_resp_sendstr(_req, "Content: error while receiving") ;
+        return false ;
+      }
+      size += n ;
+      remaining -= n ;
     }
-    if (n < 0)
+
+    size_t used{0} ;
+    bool progress{true} ;
+    while (progress && (state != State::Done))
     {
-      httpd_resp_sendstr(_req, "Content: error while receiving") ;
-      return false ;
+      const uint8_t *data = _buff + used ;
+      size_t dataSize = size - used ;
+      progress = false ;
+
+      switch (state)
+      {
+      case State::Preamble:
+      case State::Body:
+        {
+          // a body ends with the delimiter, its last bytes might be the start of one
+          const uint8_t *eob = delimiter.find(data, dataSize) ;
+          size_t n = eob ? eob - data : dataSize - std::min(dataSize, boundarySize-1) ;
+          if (n && (state == State::Body) && !dataFn(data, n))
+            return false ;
+          used += n ;
+          if (eob)
+          {
+            used += boundarySize ;
+            if ((state == State::Body) && !endFn())
+              return false ;
+            state = State::Delimiter ;
+            progress = true ;
+          }
+        }
+        break ;
+
+      case State::Delimiter:
+        if (dataSize < 2)
+          break ;
+        if (!memcmp(data, "--", 2)) // end of multipart
+          state = State::Done ;
+        else if (!memcmp(data, nl, 2))
+          state = State::Head ;
+        else
+        {
+          httpd_resp_sendstr(_req, "Content: parse failed") ;
+          return false ;
+        }
+        used += 2 ;
+        progress = true ;
+        break ;
+
+      case State::Head:
+        {
+          const uint8_t *eoh = memmem(data, dataSize, nl, 4) ;
+          if (!eoh)
+            break ;
+          std::string name ;
+          if (!parseName(data, eoh+2 - data, name))
+          {
+            httpd_resp_sendstr(_req, "Content: parse failed") ;
+            return false ;
+          }
+          if (!beginFn(name))
+            return false ;
+          used += eoh+4 - data ;
+          state = State::Body ;
+          progress = true ;
+        }
+        break ;
+
+      case State::Done:
+        break ;
+      }
     }
-    recvSize += n ;
-  }
 
-  if (!parseBody((uint8_t*)boundary, boundarySize+4, _content, contentSize))
-  {
-    httpd_resp_sendstr(_req, "Content: parse failed") ;
-    return false ;
+    if ((state != State::Done) && !used && (!remaining || (size == _buffSize)))
+    {
+      // nothing more to come or a head that does not fit
+      httpd_resp_sendstr(_req, remaining ? "Content: head too big" : "Content: too small") ;
+      return false ;
+    }
+    memmove(_buff, _buff + used, size - used) ;
+    size -= used ;
   }
   
   return true ;
 }
 
-bool MultiPart::get(const std::string &name, Part &part)
+bool MultiPart::parse(Fields &fields, size_t fieldMax)
 {
-  auto iPart = _parts.find(name) ;
-  if (iPart == _parts.end())
-    return false ;
-
-  part = iPart->second ;
-  return true ;
+  std::string name ;
+  std::string value ;
+  return parse([&](const std::string &n)
+               {
+                 name = n ;
+                 value.clear() ;
+                 return true ;
+               },
+               [&](const uint8_t *data, size_t size)
+               {
+                 if ((value.size() + size) > fieldMax)
+                 {
+                   httpd_resp_sendstr(_req, (name + " too big").c_str()) ;
+                   return false ;
+                 }
+                 value.append((const char*)data, size) ;
+                 return true ;
+               },
+               [&]()
+               {
+                 fields[name] = value ;
+                 return true ;
+               }) ;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
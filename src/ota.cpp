@@ -4,75 +4,885 @@
 
 #include "esp32-cam.hpp"
 
+#include <nvs.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
-esp_err_t ota(httpd_req_t *req)
+constexpr size_t OtaWriter::_buffSize ;
+std::atomic<bool> OtaWriter::_active{false} ;
+constexpr size_t OtaDecoder::_copySize ;
+
+OtaWriter::OtaWriter()
 {
-  ESP_LOGD("Ota", "POST Requested") ;
+  mbedtls_sha256_init(&_sha) ;
+}
 
-  httpd_resp_set_type(req, "text/plain") ;
+OtaWriter::~OtaWriter()
+{
+  stop() ;
+  if (_ota)
+  {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
+    esp_ota_abort(_ota) ;
+#else
+    esp_ota_end(_ota) ;
+#endif
+  }
+  mbedtls_sha256_free(&_sha) ;
+  if (_done)
+    vSemaphoreDelete(_done) ;
+  if (_full)
+    vQueueDelete(_full) ;
+  if (_free)
+    vQueueDelete(_free) ;
+  for (uint8_t *buff : _buffs)
+    free(buff) ;
+  if (_owner)
+    _active = false ;
+}
 
-  MultiPart multiPart(req) ;
-  if (!multiPart.parse())
-    return ESP_OK ;
+bool OtaWriter::fail(const char *fn, esp_err_t err)
+{
+  snprintf(_msg, sizeof(_msg), "%s failed (%s)", fn, esp_err_to_name(err)) ;
+  ESP_LOGE("Ota", "%s", _msg) ;
+  return false ;
+}
 
-  MultiPart::Part firmware ;
-  MultiPart::Part espPwd ;
-  if (!multiPart.get("firmware", firmware))
-    return httpd_resp_sendstr(req, "Content-Disposition: form-data; name=\"firmware\" not found") ;
+bool OtaWriter::begin(const AppFn &appFn)
+{
+  if (_active.exchange(true))
+    return fail("OtaWriter::begin", ESP_ERR_INVALID_STATE) ;
+  _owner = true ;
+  _appFn = appFn ;
 
-  if (!multiPart.get("esp-pwd", espPwd))
-    return httpd_resp_sendstr(req, "Content-Disposition: form-data; name=\"esp-pwd\" not found") ;
+  _free = xQueueCreate(2, sizeof(Chunk)) ;
+  _full = xQueueCreate(3, sizeof(Chunk)) ; // two buffers and the stop
+  _done = xSemaphoreCreateBinary() ;
+  for (uint8_t *&buff : _buffs)
+    buff = (uint8_t*) malloc(_buffSize) ;
+  if (!_free || !_full || !_done || !_buffs[0] || !_buffs[1])
+    return fail("OtaWriter::begin", ESP_ERR_NO_MEM) ;
+  for (uint8_t *buff : _buffs)
+  {
+    Chunk chunk{buff, 0} ;
+    xQueueSend(_free, &chunk, 0) ;
+  }
 
-  if (!crypto.pwdCheck(std::vector<uint8_t>(espPwd._bodyBegin, espPwd._bodyEnd)))
-    return httpd_resp_sendstr(req, "invalid password") ;
-  
-  ////////////////////////////////////////
-  
-  const esp_partition_t *part = esp_ota_get_running_partition() ;
-  if (!part)
+  _part = esp_ota_get_running_partition() ;
+  if (!_part)
+    return fail("esp_ota_get_running_partition", ESP_FAIL) ;
+  _part = esp_ota_get_next_update_partition(_part) ;  
+  if (!_part)
+    return fail("esp_ota_get_next_update_partition", ESP_FAIL) ;
+  mbedtls_sha256_starts_ret(&_sha, 0) ;
+
+  // unpinned like the httpd task, the scheduler runs it on whichever core is free
+  if (xTaskCreatePinnedToCore(writerTask, "OtaWriter", 4096, this, 5, nullptr, tskNO_AFFINITY) != pdPASS)
+    return fail("xTaskCreatePinnedToCore", ESP_ERR_NO_MEM) ;
+  _running = true ;
+  _begin = esp_timer_get_time() ;
+  return true ;
+}
+
+void OtaWriter::writerTask(void *arg)
+{
+  ((OtaWriter*) arg)->writer() ;
+  vTaskDelete(nullptr) ;
+}
+
+void OtaWriter::writer()
+{
+  Chunk chunk ;
+  while ((xQueueReceive(_full, &chunk, portMAX_DELAY) == pdTRUE) && chunk._data)
   {
-    return httpd_resp_sendstr(req, "esp_ota_get_running_partition failed") ;
+    if (!_ota && (_err == ESP_OK))
+    {
+      // nothing is erased until the image is accepted
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+      // erase sector by sector while writing instead of the whole partition up front
+      esp_err_t err = esp_ota_begin(_part, OTA_WITH_SEQUENTIAL_WRITES, &_ota) ;
+#else
+      esp_err_t err = esp_ota_begin(_part, OTA_SIZE_UNKNOWN, &_ota) ;
+#endif
+      if (err != ESP_OK)
+      {
+        _ota = 0 ;
+        _errFn = "esp_ota_begin" ;
+        _err = err ;
+      }
+    }
+    if (_err == ESP_OK)
+    {
+      mbedtls_sha256_update_ret(&_sha, chunk._data, chunk._size) ;
+      int64_t t0 = esp_timer_get_time() ;
+      _err = esp_ota_write(_ota, chunk._data, chunk._size) ;
+      _flash += esp_timer_get_time() - t0 ;
+    }
+    xQueueSend(_free, &chunk, portMAX_DELAY) ;
   }
-  
-  part = esp_ota_get_next_update_partition(part) ;  
-  if (!part)
+  xSemaphoreGive(_done) ;
+}
+
+bool OtaWriter::write(const uint8_t *data, size_t size)
+{
+  while (size)
   {
-    return httpd_resp_sendstr(req, "esp_ota_get_next_update_partition failed") ;
+    if (_err != ESP_OK)
+      return fail(_errFn, _err) ;
+
+    if (!_fill._data)
+    {
+      int64_t t0 = esp_timer_get_time() ;
+      xQueueReceive(_free, &_fill, portMAX_DELAY) ;
+      _stall += esp_timer_get_time() - t0 ;
+      _fill._size = 0 ;
+    }
+
+    size_t n = std::min(size, _buffSize - _fill._size) ;
+    memcpy(_fill._data + _fill._size, data, n) ;
+    _fill._size += n ;
+    if (_size < _headSize)
+    {
+      // the head is complete long before the first buffer goes to the writer
+      size_t h = std::min(n, _headSize - _size) ;
+      memcpy(_head + _size, data, h) ;
+      if (((_size + h) == _headSize) && !app())
+        return false ;
+    }
+    _size += n ;
+    data += n ;
+    size -= n ;
+
+    if (_fill._size == _buffSize)
+    {
+      xQueueSend(_full, &_fill, portMAX_DELAY) ;
+      _fill._data = nullptr ;
+    }
   }
+  return true ;
+}
 
-  esp_err_t err ;
-  esp_ota_handle_t ota ;
-  char msg[64] ;
-  err = esp_ota_begin(part, firmware._bodyEnd - firmware._bodyBegin, &ota) ;
-  if (err != ESP_OK)
+bool OtaWriter::stop()
+{
+  if (!_running)
+    return true ;
+  Chunk chunk{nullptr, 0} ;
+  xQueueSend(_full, &chunk, portMAX_DELAY) ;
+  xSemaphoreTake(_done, portMAX_DELAY) ;
+  _running = false ;
+  return _err == ESP_OK ;
+}
+
+bool OtaWriter::end(uint8_t sha256[32])
+{
+  if (_fill._data && _fill._size)
   {
-    sprintf(msg, "esp_ota_begin failed (%s)", esp_err_to_name(err)) ;
-    return httpd_resp_sendstr(req, msg) ;
+    xQueueSend(_full, &_fill, portMAX_DELAY) ;
+    _fill._data = nullptr ;
   }
+  if (!stop())
+    return fail(_errFn, _err) ;
+  _end = esp_timer_get_time() ;
+  mbedtls_sha256_finish_ret(&_sha, sha256) ;
 
-  err = esp_ota_write(ota, firmware._bodyBegin, firmware._bodyEnd - firmware._bodyBegin) ;
+  esp_err_t err = esp_ota_end(_ota) ;
+  _ota = 0 ;
   if (err != ESP_OK)
+    return fail("esp_ota_end", err) ;
+  ESP_LOGI("Ota", "%s", stats().c_str()) ;
+  return true ;
+}
+
+bool OtaWriter::app()
+{
+  if (!_appFn)
+    return true ;
+  esp_app_desc_t app ;
+  memcpy(&app, _head + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(app)) ;
+  if ((_head[0] != ESP_IMAGE_HEADER_MAGIC) || (app.magic_word != ESP_APP_DESC_MAGIC_WORD))
   {
-    sprintf(msg, "esp_ota_write failed (%s)", esp_err_to_name(err)) ;
-    return httpd_resp_sendstr(req, msg) ;
+    snprintf(_msg, sizeof(_msg), "firmware: app description not found") ;
+    return false ;
   }
+  if (!_appFn(app))
+  {
+    snprintf(_msg, sizeof(_msg), "firmware %.32s skipped", app.version) ;
+    return false ;
+  }
+  return true ;
+}
 
-  err = esp_ota_end(ota) ;
+bool OtaWriter::boot()
+{
+  esp_err_t err = esp_ota_set_boot_partition(_part) ;
   if (err != ESP_OK)
+    return fail("esp_ota_set_boot_partition", err) ;
+  return true ;
+}
+
+std::string OtaWriter::stats() const
+{
+  int64_t us = std::max<int64_t>(_end - _begin, 1) ;
+  char stats[128] ;
+  snprintf(stats, sizeof(stats), "%u bytes in %.1f s (%u KB/s), stalled %.1f s, flash busy %.1f s",
+           (uint32_t)_size, us / 1e6, (uint32_t)(_size * 1000000 / us / 1024),
+           _stall / 1e6, _flash / 1e6) ;
+  return stats ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+OtaDecoder::~OtaDecoder()
+{
+  free(_inflator) ;
+  free(_dict) ;
+  free(_copy) ;
+}
+
+bool OtaDecoder::fail(const char *msg)
+{
+  snprintf(_msg, sizeof(_msg), "%s", msg) ;
+  ESP_LOGE("Ota", "%s", _msg) ;
+  return false ;
+}
+
+std::string OtaDecoder::format() const
+{
+  std::string format = _zlib ? "zlib " : "" ;
+  format += (_format == Format::Delta) ? "delta" : "raw" ;
+  return format ;
+}
+
+bool OtaDecoder::write(const uint8_t *data, size_t size)
+{
+  if (!size)
+    return true ;
+  if (!_received && (data[0] == 0x78)) // zlib CMF, deflate with a 32k window
+  {
+    _zlib = true ;
+    _inflator = (tinfl_decompressor*) malloc(sizeof(tinfl_decompressor)) ;
+    _dict = (uint8_t*) malloc(TINFL_LZ_DICT_SIZE) ;
+    if (!_inflator || !_dict)
+      return fail("firmware: out of memory") ;
+    tinfl_init(_inflator) ;
+  }
+  _received += size ;
+  return _zlib ? inflate(data, size) : image(data, size) ;
+}
+
+bool OtaDecoder::inflate(const uint8_t *data, size_t size)
+{
+  const mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32 | TINFL_FLAG_HAS_MORE_INPUT ;
+  while (size || (_inflateStatus == TINFL_STATUS_HAS_MORE_OUTPUT))
+  {
+    if (_inflateStatus == TINFL_STATUS_DONE)
+      return fail("firmware: data after the zlib stream") ;
+
+    size_t in = size ;
+    size_t out = TINFL_LZ_DICT_SIZE - _dictOfs ;
+    _inflateStatus = tinfl_decompress(_inflator, data, &in, _dict, _dict + _dictOfs, &out, flags) ;
+    if (_inflateStatus < 0)
+      return fail("firmware: zlib stream corrupt") ;
+    data += in ;
+    size -= in ;
+    if (out && !image(_dict + _dictOfs, out))
+      return false ;
+    _dictOfs = (_dictOfs + out) & (TINFL_LZ_DICT_SIZE - 1) ;
+  }
+  return true ;
+}
+
+bool OtaDecoder::image(const uint8_t *data, size_t size)
+{
+  if (_format == Format::Unknown)
   {
-    sprintf(msg, "esp_ota_end failed (%s)", esp_err_to_name(err)) ;
-    return httpd_resp_sendstr(req, msg) ;
+    if (data[0] == ESP_IMAGE_HEADER_MAGIC)
+      _format = Format::Raw ;
+    else if (data[0] == 'E')
+      _format = Format::Delta ;
+    else
+      return fail("firmware: unknown image format") ;
   }
+  return (_format == Format::Raw) ? output(data, size) : delta(data, size) ;
+}
 
-  err = esp_ota_set_boot_partition(part) ;
+bool OtaDecoder::output(const uint8_t *data, size_t size)
+{
+  if (!_writer.write(data, size))
+    return fail(_writer.msg()) ;
+  return true ;
+}
+
+bool OtaDecoder::delta(const uint8_t *data, size_t size)
+{
+  while (size)
+  {
+    switch (_state)
+    {
+    case State::Header:
+    case State::Op:
+      {
+        size_t n = std::min(size, _fieldNeed - _fieldSize) ;
+        memcpy(_field + _fieldSize, data, n) ;
+        _fieldSize += n ;
+        data += n ;
+        size -= n ;
+        if ((_state == State::Op) && (_fieldSize == 1))
+        {
+          switch (_field[0])
+          {
+          case 'C': _fieldNeed = 9 ; break ;
+          case 'D': _fieldNeed = 5 ; break ;
+          case 'E': _fieldNeed = 1 ; break ;
+          default: return fail("firmware: delta op unknown") ;
+          }
+        }
+        if (_fieldSize < _fieldNeed)
+          break ;
+        if (!((_state == State::Header) ? header() : op()))
+          return false ;
+        _fieldSize = 0 ;
+        _fieldNeed = 1 ;
+      }
+      break ;
+
+    case State::Data:
+      {
+        size_t n = std::min<size_t>(size, _dataSize) ;
+        if (!output(data, n))
+          return false ;
+        data += n ;
+        size -= n ;
+        _dataSize -= n ;
+        if (!_dataSize)
+          _state = State::Op ;
+      }
+      break ;
+
+    case State::Done:
+      return fail("firmware: data after the delta") ;
+    }
+  }
+  return true ;
+}
+
+bool OtaDecoder::header()
+{
+  DeltaHeader header ;
+  memcpy(&header, _field, sizeof(header)) ;
+  if (memcmp(header._magic, "ESPD", 4) || (header._format != _deltaFormat))
+    return fail("firmware: delta header invalid") ;
+  _oldSize = header._oldSize ;
+  _newSize = header._newSize ;
+
+  _running = esp_ota_get_running_partition() ;
+  if (!_running || (_oldSize > _running->size))
+    return fail("firmware: delta base does not fit the running partition") ;
+  _copy = (uint8_t*) malloc(_copySize) ;
+  if (!_copy)
+    return fail("firmware: out of memory") ;
+
+  // a delta only applies to the image it was made against
+  mbedtls_sha256_context ctx ;
+  uint8_t sha256[32] ;
+  mbedtls_sha256_init(&ctx) ;
+  mbedtls_sha256_starts_ret(&ctx, 0) ;
+  esp_err_t err = ESP_OK ;
+  for (uint32_t offset = 0 ; (err == ESP_OK) && (offset < _oldSize) ; offset += _copySize)
+  {
+    size_t n = std::min<size_t>(_copySize, _oldSize - offset) ;
+    err = esp_partition_read(_running, offset, _copy, n) ;
+    mbedtls_sha256_update_ret(&ctx, _copy, n) ;
+  }
+  mbedtls_sha256_finish_ret(&ctx, sha256) ;
+  mbedtls_sha256_free(&ctx) ;
   if (err != ESP_OK)
+    return fail("firmware: esp_partition_read failed") ;
+  if (memcmp(sha256, header._oldSha256, sizeof(sha256)))
+    return fail("firmware: delta made against another firmware") ;
+
+  _state = State::Op ;
+  return true ;
+}
+
+bool OtaDecoder::op()
+{
+  uint32_t arg1{0} ;
+  uint32_t arg2{0} ;
+  memcpy(&arg1, _field + 1, std::min<size_t>(_fieldNeed - 1, 4)) ;
+  if (_fieldNeed == 9)
+    memcpy(&arg2, _field + 5, 4) ;
+
+  switch (_field[0])
+  {
+  case 'C':
+    return copy(arg1, arg2) ;
+  case 'D':
+    if (arg1 > (_newSize - _written))
+      return fail("firmware: delta data too big") ;
+    _written += arg1 ;
+    _dataSize = arg1 ;
+    if (_dataSize)
+      _state = State::Data ;
+    return true ;
+  default: // 'E'
+    if (_written != _newSize)
+      return fail("firmware: delta size mismatch") ;
+    _state = State::Done ;
+    return true ;
+  }
+}
+
+bool OtaDecoder::copy(uint32_t offset, uint32_t length)
+{
+  if ((offset > _oldSize) || (length > (_oldSize - offset)) || (length > (_newSize - _written)))
+    return fail("firmware: delta copy out of range") ;
+  _written += length ;
+  while (length)
+  {
+    size_t n = std::min<size_t>(_copySize, length) ;
+    if (esp_partition_read(_running, offset, _copy, n) != ESP_OK)
+      return fail("firmware: esp_partition_read failed") ;
+    if (!output(_copy, n))
+      return false ;
+    offset += n ;
+    length -= n ;
+  }
+  return true ;
+}
+
+bool OtaDecoder::end()
+{
+  if (_zlib && (_inflateStatus != TINFL_STATUS_DONE))
+    return fail("firmware: zlib stream truncated") ;
+  if (_format == Format::Unknown)
+    return fail("firmware: empty") ;
+  if ((_format == Format::Delta) && (_state != State::Done))
+    return fail("firmware: delta truncated") ;
+  return true ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+OtaPull otaPull ;
+
+bool OtaPull::init()
+{
+  std::string url, interval, stageDelay ;
+  int16_t v ;
+  if (!privateSettings.get("ota.url", url) || url.empty())
+  {
+    status("ota.url not set") ;
+    return true ;
+  }
+  if (privateSettings.get("ota.interval", interval) && to_i(interval, v))
+    _interval = v ;
+  if (privateSettings.get("ota.stage-delay", stageDelay) && to_i(stageDelay, v))
+    _stageDelay = v ;
+
+  nvs_handle_t nvs ;
+  if (nvs_open("ota", NVS_READONLY, &nvs) == ESP_OK)
+  {
+    size_t size = sizeof(_seen) ;
+    if ((nvs_get_blob(nvs, "seen", &_seen, &size) != ESP_OK) || (size != sizeof(_seen)))
+      _seen = Seen{} ;
+    nvs_close(nvs) ;
+  }
+
+  _trigger = xSemaphoreCreateBinary() ;
+  if (!_trigger)
+    return false ;
+  if (xTaskCreatePinnedToCore(pullTask, "OtaPull", 8192, this, 2, &_task, tskNO_AFFINITY) != pdPASS)
+  {
+    ESP_LOGE("Ota", "xTaskCreatePinnedToCore() failed") ;
+    return false ;
+  }
+  return true ;
+}
+
+bool OtaPull::trigger(const std::string &sha256)
+{
+  if (!_task)
+    return false ;
+  {
+    std::lock_guard<std::mutex> lock(_mutex) ;
+    _sha256 = sha256 ;
+  }
+  xSemaphoreGive(_trigger) ;
+  return true ;
+}
+
+void OtaPull::status(const std::string &status)
+{
+  ESP_LOGI("Ota", "pull: %s", status.c_str()) ;
+  std::lock_guard<std::mutex> lock(_mutex) ;
+  _status = status ;
+}
+
+std::string OtaPull::status() const
+{
+  std::lock_guard<std::mutex> lock(_mutex) ;
+  return _status ;
+}
+
+void OtaPull::pullTask(void *arg)
+{
+  ((OtaPull*) arg)->pull() ;
+}
+
+void OtaPull::pull()
+{
+  // pdMS_TO_TICKS() overflows for a day
+  TickType_t wait = _interval ? (TickType_t)_interval * 60 * configTICK_RATE_HZ : portMAX_DELAY ;
+  for (;;)
+  {
+    xSemaphoreTake(_trigger, wait) ;
+
+    // /setup writes them on the httpd task, both are taken from the same write
+    Settings::Pairs pairs{ { "ota.url", "" }, { "ota.sha256", "" } } ;
+    privateSettings.get(pairs) ;
+    std::string sha256 ;
+    {
+      std::lock_guard<std::mutex> lock(_mutex) ;
+      sha256.swap(_sha256) ;
+    }
+    if (sha256.empty())
+      sha256 = pairs[1].second ;
+    if (update(pairs[0].second, sha256))
+    {
+      terminator.hastaLaVistaBaby() ;
+      vTaskDelete(nullptr) ;
+    }
+  }
+}
+
+esp_err_t OtaPull::event(esp_http_client_event_t *evt)
+{
+  OtaPull *self = (OtaPull*) evt->user_data ;
+  if (evt->event_id != HTTP_EVENT_ON_HEADER)
+    return ESP_OK ;
+
+  if (!strcasecmp(evt->header_key, "ETag"))
+    self->_etag = evt->header_value ;
+  else if (!strcasecmp(evt->header_key, "Content-Range"))
+  {
+    // bytes <start>-<end>/<size>
+    unsigned start ;
+    if (sscanf(evt->header_value, "bytes %u-", &start) == 1)
+      self->_rangeStart = start ;
+  }
+  return ESP_OK ;
+}
+
+bool OtaPull::accept(const esp_app_desc_t &app)
+{
+  const esp_app_desc_t *running = esp_ota_get_app_description() ;
+  if (!memcmp(app.app_elf_sha256, running->app_elf_sha256, sizeof(app.app_elf_sha256)))
+  {
+    _skipped = true ;
+    status(std::string("firmware ") + running->version + " is up to date") ;
+    return false ;
+  }
+
+  // the delay counts uptime from the first check that saw the image, a reboot keeps it
+  int64_t now = esp_timer_get_time() ;
+  if (memcmp(app.app_elf_sha256, _seen._sha, sizeof(_seen._sha)))
+  {
+    memcpy(_seen._sha, app.app_elf_sha256, sizeof(_seen._sha)) ;
+    _seen._for = 0 ;
+  }
+  else
+    _seen._for += (now - _checked) / 1000000 ;
+  _checked = now ;
+
+  int64_t left = (int64_t)_stageDelay * 3600 - _seen._for ; // [s]
+  if (left > 0)
+  {
+    saveSeen() ;
+    char msg[96] ;
+    snprintf(msg, sizeof(msg), "firmware %.32s deferred by ota.stage-delay, %u min left",
+             app.version, (uint32_t)(left / 60 + 1)) ;
+    _skipped = true ;
+    status(msg) ;
+    return false ;
+  }
+  return true ;
+}
+
+void OtaPull::saveSeen()
+{
+  nvs_handle_t nvs ;
+  if (nvs_open("ota", NVS_READWRITE, &nvs) != ESP_OK)
+  {
+    ESP_LOGE("Ota", "nvs_open() failed") ;
+    return ;
+  }
+  if ((nvs_set_blob(nvs, "seen", &_seen, sizeof(_seen)) != ESP_OK) || (nvs_commit(nvs) != ESP_OK))
+    ESP_LOGW("Ota", "nvs_set_blob(seen) failed") ;
+  nvs_close(nvs) ;
+}
+
+bool OtaPull::update(const std::string &url, const std::string &expected)
+{
+  // anyone on the path to ota.url could serve an image, it has to be pinned or signed
+#ifndef CONFIG_SECURE_SIGNED_ON_UPDATE
+  if (expected.empty())
+  {
+    status("ota.sha256 not set, unsigned firmware is not pulled") ;
+    return false ;
+  }
+#endif
+  status("checking") ; // the url may carry credentials, the status is public
+  _skipped = false ;
+
+  OtaWriter writer ;
+  OtaDecoder decoder(writer) ;
+  bool begun{false} ;
+
+  esp_http_client_config_t config{} ;
+  config.url = url.c_str() ;
+  config.timeout_ms = 10000 ;
+  config.event_handler = event ;
+  config.user_data = this ;
+  esp_http_client_handle_t client = esp_http_client_init(&config) ;
+  std::unique_ptr<char[]> buff(new (std::nothrow) char[_chunkSize]) ;
+  if (!client || !buff)
+  {
+    if (client)
+      esp_http_client_cleanup(client) ;
+    status("esp_http_client_init failed") ;
+    return false ;
+  }
+
+  // a download is resumed at offset, if-range makes the server send
+  // the whole file again if it changed in between
+  std::string error ;
+  std::string etag ;
+  size_t offset{0} ;
+  int attempt{0} ;
+  bool done{false} ;
+  while (!done && error.empty())
+  {
+    char range[32] ;
+    if (offset)
+    {
+      snprintf(range, sizeof(range), "bytes=%u-", (uint32_t)offset) ;
+      esp_http_client_set_header(client, "Range", range) ;
+      if (etag.size())
+        esp_http_client_set_header(client, "If-Range", etag.c_str()) ;
+    }
+    _etag.clear() ;
+    _rangeStart = -1 ;
+
+    bool interrupted = true ;
+    if ((esp_http_client_open(client, 0) == ESP_OK) &&
+        (esp_http_client_fetch_headers(client) >= 0))
+    {
+      interrupted = false ;
+      int status = esp_http_client_get_status_code(client) ;
+      size_t skip{0} ;
+      if (!offset)
+      {
+        if (status == 200)
+          etag = _etag ;
+        else
+          error = "HTTP status " + to_s((int32_t)status) ;
+      }
+      else if (status == 200)
+      {
+        if (etag.size() && (etag != _etag))
+          error = "firmware changed on the server during the download" ;
+        skip = offset ; // no range support, skip what is written already
+      }
+      else if ((status != 206) || (_rangeStart != (int64_t)offset))
+        error = "HTTP status " + to_s((int32_t)status) + " for range " + range ;
+
+      // the writer task and its buffers only once there is an image to write
+      if (error.empty() && !begun)
+      {
+        begun = writer.begin([this](const esp_app_desc_t &app) { return accept(app) ; }) ;
+        if (!begun)
+          error = writer.msg() ;
+      }
+
+      while (error.empty())
+      {
+        int n = esp_http_client_read(client, buff.get(), _chunkSize) ;
+        if (n <= 0)
+        {
+          if (!n && esp_http_client_is_complete_data_received(client))
+            done = true ;
+          else
+            interrupted = true ;
+          break ;
+        }
+        const char *data = buff.get() ;
+        size_t s = std::min(skip, (size_t)n) ;
+        data += s ;
+        n -= s ;
+        skip -= s ;
+        if (n && !decoder.write((const uint8_t*)data, n))
+          error = decoder.msg() ;
+        offset += n ;
+        if (n)
+          attempt = 0 ;
+      }
+    }
+    esp_http_client_close(client) ;
+
+    if (interrupted && error.empty())
+    {
+      if (++attempt > _retries)
+        error = "download interrupted " + to_s((int32_t)_retries) + " times" ;
+      else
+      {
+        ESP_LOGW("Ota", "pull: interrupted, resuming at %u", (uint32_t)offset) ;
+        vTaskDelay(pdMS_TO_TICKS(1000 * attempt)) ;
+      }
+    }
+  }
+  esp_http_client_cleanup(client) ;
+
+  uint8_t sha256[32] ;
+  if (error.empty() && !decoder.end())
+    error = decoder.msg() ;
+  if (error.empty() && !writer.end(sha256))
+    error = writer.msg() ;
+  if (error.empty() && expected.size())
   {
-    sprintf(msg, "esp_ota_set_boot_partition failed (%s)", esp_err_to_name(err)) ;
-    return httpd_resp_sendstr(req, msg) ;
+    char hex[65] ;
+    for (int i = 0 ; i < 32 ; ++i)
+      sprintf(hex + 2*i, "%02x", sha256[i]) ;
+    if (strcasecmp(expected.c_str(), hex))
+      error = std::string("sha256 mismatch, received ") + hex ;
   }
+  if (error.empty() && !writer.boot())
+    error = writer.msg() ;
+  if (error.size())
+  {
+    if (!_skipped)
+      status(error) ;
+    return false ;
+  }
+
+  status("Update successful (" + decoder.format() + "), " + writer.stats() + ", booting new firmware ...") ;
+  return true ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+esp_err_t ota(httpd_req_t *req)
+{
+  ESP_LOGD("Ota", "POST Requested") ;
+
+  httpd_resp_set_type(req, "text/plain") ;
+
+  // the firmware goes to flash while it is received, esp-pwd has to come first
+  // firmware-sha256 (hex, of the decoded image) is optional, it may come before or after the firmware
+  // the firmware may be raw, zlib compressed and/or a delta against the running one
+  std::string name ;
+  std::string espPwd ;
+  std::string expected ;
+  bool authorized{false} ;
+  bool started{false} ;
+  bool written{false} ;
+  uint8_t sha256[32] ;
+
+  OtaWriter writer ;
+  OtaDecoder decoder(writer) ;
+  MultiPart multiPart(req) ;
+  bool ok = multiPart.parse([&](const std::string &n)
+                            {
+                              name = n ;
+                              if (name != "firmware")
+                                return true ;
+                              if (!authorized)
+                              {
+                                httpd_resp_sendstr(req, "Content-Disposition: form-data; name=\"esp-pwd\" has to precede \"firmware\"") ;
+                                return false ;
+                              }
+                              if (started)
+                              {
+                                httpd_resp_sendstr(req, "Content-Disposition: form-data; name=\"firmware\" twice") ;
+                                return false ;
+                              }
+                              started = true ;
+                              if (!writer.begin())
+                              {
+                                httpd_resp_sendstr(req, writer.msg()) ;
+                                return false ;
+                              }
+                              return true ;
+                            },
+                            [&](const uint8_t *data, size_t size)
+                            {
+                              if ((name == "esp-pwd") || (name == "firmware-sha256"))
+                              {
+                                std::string &field = (name == "esp-pwd") ? espPwd : expected ;
+                                if ((field.size() + size) > 64)
+                                {
+                                  httpd_resp_sendstr(req, (name + " too big").c_str()) ;
+                                  return false ;
+                                }
+                                field.append((const char*)data, size) ;
+                              }
+                              else if ((name == "firmware") && !decoder.write(data, size))
+                              {
+                                httpd_resp_sendstr(req, decoder.msg()) ;
+                                return false ;
+                              }
+                              return true ;
+                            },
+                            [&]()
+                            {
+                              if (name == "esp-pwd")
+                              {
+                                authorized = crypto.pwdCheck(std::vector<uint8_t>(espPwd.begin(), espPwd.end())) ;
+                                if (!authorized)
+                                {
+                                  httpd_resp_sendstr(req, "invalid password") ;
+                                  return false ;
+                                }
+                              }
+                              else if (name == "firmware")
+                              {
+                                if (!decoder.end())
+                                {
+                                  httpd_resp_sendstr(req, decoder.msg()) ;
+                                  return false ;
+                                }
+                                if (!writer.end(sha256))
+                                {
+                                  httpd_resp_sendstr(req, writer.msg()) ;
+                                  return false ;
+                                }
+                                written = true ;
+                              }
+                              return true ;
+                            }) ;
+  if (!ok)
+    return ESP_OK ;
+  if (!written)
+    return httpd_resp_sendstr(req, authorized ?
+                              "Content-Disposition: form-data; name=\"firmware\" not found" :
+                              "Content-Disposition: form-data; name=\"esp-pwd\" not found") ;
+
+  ////////////////////////////////////////
+
+  char hex[65] ;
+  for (int i = 0 ; i < 32 ; ++i)
+    sprintf(hex + 2*i, "%02x", sha256[i]) ;
+  if (expected.size() && strcasecmp(expected.c_str(), hex))
+  {
+    ESP_LOGE("Ota", "sha256 %s expected %s", hex, expected.c_str()) ;
+    return httpd_resp_sendstr(req, (std::string("firmware-sha256 mismatch, received ") + hex).c_str()) ;
+  }
+
+  if (!writer.boot())
+    return httpd_resp_sendstr(req, writer.msg()) ;
   
-  httpd_resp_sendstr(req, "Upload successful, booting new firmware ...") ;
+  std::string msg = "Upload successful (" + decoder.format() + "), " + writer.stats() + ", sha256 " + hex + ", booting new firmware ..." ;
+  httpd_resp_sendstr(req, msg.c_str()) ;
   ESP_LOGW("Ota", "booting new firmware") ;
 
   terminator.hastaLaVistaBaby() ;
@@ -80,6 +890,36 @@ esp_err_t ota(httpd_req_t *req)
   return ESP_OK ;
 }
 
+esp_err_t pull(httpd_req_t *req)
+{
+  ESP_LOGD("Ota", "pull Requested") ;
+
+  httpd_resp_set_type(req, "text/plain") ;
+
+  if (req->method == HTTP_GET)
+  {
+    std::string status = otaPull.status() ;
+    return httpd_resp_send(req, status.data(), status.size()) ;
+  }
+
+  MultiPart::Fields fields ;
+  MultiPart multiPart(req) ;
+  if (!multiPart.parse(fields, 64))
+    return ESP_OK ;
+
+  auto espPwd = fields.find("esp-pwd") ;
+  if (espPwd == fields.end())
+    return httpd_resp_sendstr(req, "Content-Disposition: form-data; name=\"esp-pwd\" not found") ;
+  if (!crypto.pwdCheck(std::vector<uint8_t>(espPwd->second.begin(), espPwd->second.end())))
+    return httpd_resp_sendstr(req, "invalid password") ;
+
+  // firmware-sha256 (hex, of the decoded image) pins the image of this check instead of ota.sha256
+  auto sha256 = fields.find("firmware-sha256") ;
+  if (!otaPull.trigger((sha256 != fields.end()) ? sha256->second : std::string()))
+    return httpd_resp_sendstr(req, "ota.url not set") ;
+  return httpd_resp_sendstr(req, "Firmware check started") ;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // EOF
 ////////////////////////////////////////////////////////////////////////////////
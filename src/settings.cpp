@@ -4,156 +4,174 @@
 
 #include "esp32-cam.hpp"
 
-////////////////////////////////////////////////////////////////////////////////
-
-PrivateSettings privateSettings ;
-PublicSettings  publicSettings ;
-
-////////////////////////////////////////////////////////////////////////////////
-
-Setting::Setting(const std::string &category, const std::string &name) :
-  _category{category}, _name{name}
-{
-}
-Setting::~Setting()
-{
-}
-
-const std::string& Setting::category() const { return _category ; }
-const std::string& Setting::name()     const { return _name     ; }
-const std::string& Setting::value()    const { return _value    ; }
+#include <nvs.h>
+#include <esp_crc.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
-SettingStr::SettingStr(const std::string &category, const std::string &name, IniFn iniFn, SetFn setFn) :
-  Setting(category, name), _iniFn{iniFn}, _setFn{setFn}
-{
-}
+template<size_t N>
+constexpr size_t countof(const SettingDef (&)[N]) { return N ; }
 
-void SettingStr::init(Settings &settings)
+constexpr int keyCmp(const char *a, const char *b)
 {
-  if (_iniFn)
-    _value = _iniFn(settings) ;
+  return (*a != *b) ? (((unsigned char)*a < (unsigned char)*b) ? -1 : 1) : (*a ? keyCmp(a+1, b+1) : 0) ;
 }
 
-bool SettingStr::set(Settings &settings, const std::string &value)
+// byKey has to list the defs strictly sorted by key
+template<size_t N>
+constexpr bool sorted(const SettingDef (&defs)[N], const uint8_t (&byKey)[N], size_t i = 1)
 {
-  _value = value ;
-  if (_setFn)
-    _setFn(settings, _value) ;
-  return true ;
+  return (i >= N) ||
+    ((byKey[i-1] < N) && (byKey[i] < N) &&
+     (keyCmp(defs[byKey[i-1]]._key, defs[byKey[i]]._key) < 0) &&
+     sorted(defs, byKey, i+1)) ;
 }
 
-std::string SettingStr::json()
+// esp_random() is only pseudo random before the radio is up, a boot counter
+// keeps the etags of consecutive boots apart, once per boot for all settings
+static uint32_t bootCount()
 {
-  return
-    jsonStr("type" , "str") + ", " +
-    jsonStr("value", _value) ;
+  static uint32_t count{0} ;
+  if (count)
+    return count ;
+
+  nvs_handle_t nvs ;
+  if (nvs_open("settings", NVS_READWRITE, &nvs) != ESP_OK)
+    return 0 ;
+  nvs_get_u32(nvs, "boot", &count) ;
+  ++count ;
+  if ((nvs_set_u32(nvs, "boot", count) != ESP_OK) || (nvs_commit(nvs) != ESP_OK))
+    ESP_LOGW("Settings", "boot counter not saved") ;
+  nvs_close(nvs) ;
+  return count ;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Settings
 ////////////////////////////////////////////////////////////////////////////////
 
-bool SettingInt::inRange(int16_t &i) const
+Settings::Settings(const char *nvsKey, const char *fileName, const SettingDef *defs, const uint8_t *byKey, SettingValue *values, uint8_t size) :
+  _nvsKey{nvsKey}, _fileName{fileName}, _defs{defs}, _byKey{byKey}, _values{values}, _size{size}
 {
-  return (_min <= i) && (i <= _max) ;
 }
 
-SettingInt::SettingInt(const std::string &category, const std::string &name, IniFn iniFn, SetFn setFn, int16_t min, int16_t max) :
-  Setting(category, name), _iniFn{iniFn}, _setFn{setFn}, _min{min}, _max{max}
+Settings::~Settings()
 {
 }
 
-void SettingInt::init(Settings &settings)
+bool Settings::init()
 {
-  if (_iniFn)
-    _value = to_s(_iniFn(settings)) ;
-}
+  _boot = (bootCount() << 16) | (esp_random() & 0xffff) ;
+  _version = 1 ;
+  _jsonVersion = 0 ;
+  for (uint8_t i = 0 ; i < _size ; ++i)
+  {
+    const SettingDef &def = _defs[i] ;
+    SettingValue &value = _values[i] ;
+    if (def._type == SettingDef::Type::Str)
+      value._str = def._default ? def._default : "" ;
+    else if (def._iniFn)
+      value._int = def._iniFn() ;
+    else
+      value._int = (def._type == SettingDef::Type::Int) ? def._min : -1 ;
+    value._version = _version ;
+  }
 
-bool SettingInt::set(Settings &settings, const std::string &value)
-{
-  int16_t v ;
-  if (!to_i(value, v) || !inRange(v))
-    return false ;
+  load() ;
 
-  _value = value ;
-  if (_setFn)
-    _setFn(settings, v) ;
   return true ;
 }
 
-std::string SettingInt::json()
-{
-  return
-    jsonStr("type" , "int") + ", " +
-    jsonInt("min"  , _min ) + ", " +
-    jsonInt("max"  , _max ) + ", " +
-    jsonInt("value", _value) ;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-SettingEnum::SettingEnum(const std::string &category, const std::string &name, IniFn iniFn, SetFn setFn, const std::vector<std::string> &enums) :
-  Setting(category, name), _iniFn{iniFn}, _setFn{setFn}, _enum{enums}
-{
-}
-
-void SettingEnum::init(Settings &settings)
-{
-  if (_iniFn)
-    _value = _iniFn(settings, _enum) ;
-}
-
-bool SettingEnum::set(Settings &settings, const std::string &value)
+bool Settings::terminate()
 {
-  _value = value ;
-  if (_setFn)
-    _setFn(settings, _enum, _value) ;
   return true ;
 }
 
-std::string SettingEnum::json()
+bool Settings::load()
 {
-  return
-    jsonStr("type", "enum") + ", " +
-    jsonArr("enum", _enum) + ", " +
-    jsonStr("value", _value) ;
-}
+  bool result = loadNvs() ;
 
-////////////////////////////////////////////////////////////////////////////////
-// Settings
-////////////////////////////////////////////////////////////////////////////////
-
-Settings::Settings(const std::string &fileName, const std::vector<Setting*> &settings) :
-  _fileName(fileName), _settings(settings)
-{
-  for (Setting *setting : _settings)
+  // the import file (uploadfs) overrides, once it is stored in nvs it is removed
+  if (loadText())
   {
-    _settingByName[setting->category() + "." + setting->name()] = setting ;
+    if (save())
+      spifs.remove(_fileName) ;
+    result = true ;
   }
+  return result ;
 }
 
-Settings::~Settings()
+bool Settings::loadNvs()
 {
-  for (Setting *setting : _settings)
-    delete setting ;  
-}
+  nvs_handle_t nvs ;
+  if (nvs_open("settings", NVS_READONLY, &nvs) != ESP_OK)
+    return false ;
 
-bool Settings::init()
-{
-  for (Setting *setting : _settings)
-    setting->init(*this) ;
-  
-  load() ;
+  // heap, not the small main task stack
+  std::unique_ptr<uint8_t[]> mem(new (std::nothrow) uint8_t[_recordMax]) ;
+  if (!mem)
+  {
+    nvs_close(nvs) ;
+    return false ;
+  }
+  uint8_t *buff = mem.get() ;
+  size_t size = _recordMax ;
+  esp_err_t err = nvs_get_blob(nvs, _nvsKey, buff, &size) ;
+  nvs_close(nvs) ;
+  if (err != ESP_OK)
+  {
+    if (err != ESP_ERR_NVS_NOT_FOUND)
+      ESP_LOGW("Settings", "nvs_get_blob(%s) failed %d", _nvsKey, err) ;
+    return false ;
+  }
 
-  return true ;
-}
+  Header header ;
+  if (size < sizeof(header))
+    return false ;
+  memcpy(&header, buff, sizeof(header)) ;
+  const uint8_t *r = buff + sizeof(header) ;
+  const uint8_t *e = r + header._size ;
+  if ((header._magic != _magic) || (header._format != _format) ||
+      ((sizeof(header) + header._size) != size) ||
+      (esp_crc32_le(0, r, header._size) != header._crc))
+  {
+    ESP_LOGE("Settings", "%s: invalid record", _nvsKey) ;
+    return false ;
+  }
 
-bool Settings::terminate()
-{
+  // values are used in place, no parsing copies
+  for (uint8_t n = 0 ; n < header._count ; ++n)
+  {
+    if ((e - r) < 1) return false ;
+    const char *key = (const char*) r + 1 ;
+    size_t keySize = *r ;
+    r += 1 + keySize ;
+    if ((e - r) < 1) return false ;
+    const char *val = (const char*) r + 1 ;
+    size_t valSize = *r ;
+    r += 1 + valSize ;
+    if (r > e) return false ;
+
+    int16_t v{0} ;
+    int i = find(key, keySize) ;
+    if (i < 0)
+      continue ; // setting was dropped from the table
+    if (_defs[i]._type == SettingDef::Type::Int)
+    {
+      if (valSize != sizeof(v))
+        continue ;
+      memcpy(&v, val, sizeof(v)) ;
+      if ((v < _defs[i]._min) || (_defs[i]._max < v))
+        continue ;
+    }
+    else if (!parse(i, val, valSize, v))
+      continue ;
+    set(i, val, valSize, v) ;
+  }
   return true ;
 }
 
-bool Settings::load()
+bool Settings::loadText()
 {
   std::string text ;
   if (!spifs.read(_fileName, text))
@@ -170,196 +188,451 @@ bool Settings::load()
     e = strchr(v, '\n') ;
     if (!e)
       e = text.c_str() + text.size() ;
-    std::string key{k, (size_t)(v-k)} ;
-    ESP_LOGD("Settings", "%s %s %s", _fileName.c_str(), key.c_str(), std::string(v+1, e-(v+1)).c_str()) ;
-    auto iSetting = _settingByName.find(key) ;
-    if (iSetting != _settingByName.end())
-      iSetting->second->set(*this, std::string(v+1, e-(v+1))) ;
+    ESP_LOGD("Settings", "%s %.*s %.*s", _fileName, (int)(v-k), k, (int)(e-(v+1)), v+1) ;
+    int16_t val ;
+    int i = find(k, v-k) ;
+    if ((i >= 0) && parse(i, v+1, e-(v+1), val))
+      set(i, v+1, e-(v+1), val) ;
 
+    if (!*e)
+      break ;
     k = e+1 ;
   }
-    
+
   return true ;
 }
 
 bool Settings::save() const
 {
-  std::string text ;
-  for (Setting *setting : _settings)
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  std::unique_ptr<uint8_t[]> mem(new (std::nothrow) uint8_t[_recordMax]) ;
+  if (!mem)
+  {
+    ESP_LOGE("Settings", "%s: out of memory", _nvsKey) ;
+    return false ;
+  }
+  uint8_t *buff = mem.get() ;
+  Header header{ _magic, _format, _size, 0, 0 } ;
+  uint8_t *r = buff + sizeof(header) ;
+  const uint8_t *e = buff + _recordMax ;
+  for (uint8_t i = 0 ; i < _size ; ++i)
   {
-    std::string value ;
-    text += setting->category() + "." + setting->name() + "=" + setting->value() + "\n" ;
+    const SettingDef &def = _defs[i] ;
+    const SettingValue &value = _values[i] ;
+    const char *val ;
+    size_t valSize ;
+    switch (def._type)
+    {
+    case SettingDef::Type::Int:
+      val = (const char*) &value._int ;
+      valSize = sizeof(value._int) ;
+      break ;
+    case SettingDef::Type::Enum:
+      val = ((value._int >= 0) && (value._int < def._enumSize)) ? def._enums[value._int] : "" ;
+      valSize = strlen(val) ;
+      break ;
+    default:
+      val = value._str.data() ;
+      valSize = value._str.size() ;
+      break ;
+    }
+    size_t keySize = strlen(def._key) ;
+    if ((keySize > 255) || (valSize > 255) || ((size_t)(e - r) < (2 + keySize + valSize)))
+    {
+      ESP_LOGE("Settings", "%s: %s does not fit", _nvsKey, def._key) ;
+      return false ;
+    }
+    *r++ = keySize ;
+    memcpy(r, def._key, keySize) ;
+    r += keySize ;
+    *r++ = valSize ;
+    memcpy(r, val, valSize) ;
+    r += valSize ;
   }
-  
-  return spifs.write(_fileName, text) ;
+  header._size = r - (buff + sizeof(header)) ;
+  header._crc = esp_crc32_le(0, buff + sizeof(header), header._size) ;
+  memcpy(buff, &header, sizeof(header)) ;
+
+  // nvs replaces the blob atomically, a power cut keeps the old one
+  nvs_handle_t nvs ;
+  if (nvs_open("settings", NVS_READWRITE, &nvs) != ESP_OK)
+  {
+    ESP_LOGE("Settings", "nvs_open() failed") ;
+    return false ;
+  }
+  bool result = (nvs_set_blob(nvs, _nvsKey, buff, r - buff) == ESP_OK) && (nvs_commit(nvs) == ESP_OK) ;
+  nvs_close(nvs) ;
+  if (!result)
+    ESP_LOGE("Settings", "%s: nvs write failed", _nvsKey) ;
+  return result ;
 }
 
-std::string Settings::json() const
+void Settings::json(JsonWriter &json, uint32_t since) const
 {
-  std::string text ;
-  std::string category ;
-  bool first{true} ;
-  bool firstCategory{true} ; 
-  
-  text += "{ " ;
-  for (Setting *setting : _settings)
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  const char *category{nullptr} ;
+  size_t categorySize{0} ;
+
+  json.obj() ;
+  for (uint8_t i = 0 ; i < _size ; ++i)
   {
-    if (category != setting->category())
+    const SettingDef &def = _defs[i] ;
+    const SettingValue &value = _values[i] ;
+    if (value._version <= since)
+      continue ;
+
+    const char *name = strchr(def._key, '.') + 1 ;
+    size_t size = name - 1 - def._key ;
+    if (!category || (size != categorySize) || strncmp(category, def._key, size))
     {
-      category = setting->category() ;
-      if (firstCategory)
-        firstCategory = false ;
-      else
-        text += " }, " ;
-
-      first = true ;
-      text += "\"" + setting->category() + "\": { " ;
+      if (category)
+        json.end() ;
+      category = def._key ;
+      categorySize = size ;
+      json.obj(category, categorySize) ;
     }
 
-    if (first)
-      first = false ;
-    else
-      text += ", " ;
+    json.obj(name) ;
+    switch (def._type)
+    {
+    case SettingDef::Type::Str:
+      json.str("type" , "str")
+          .str("value", value._str) ;
+      break ;
+    case SettingDef::Type::Int:
+      json.str("type" , "int")
+          .num("min"  , def._min)
+          .num("max"  , def._max)
+          .num("value", value._int) ;
+      break ;
+    case SettingDef::Type::Enum:
+      json.str("type", "enum")
+          .arr("enum") ;
+      for (uint8_t e = 0 ; e < def._enumSize ; ++e)
+        json.str(nullptr, def._enums[e]) ;
+      json.end()
+          .str("value", ((value._int >= 0) && (value._int < def._enumSize)) ? def._enums[value._int] : "") ;
+      break ;
+    }
+    json.end() ;
+  }
+  if (category)
+    json.end() ;
+  json.end() ;
+}
+
+const std::string& Settings::json() const
+{
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  if (_jsonVersion != _version)
+  {
+    // keeps the capacity of the previous document
+    _json.clear() ;
+    _json.reserve(1024) ;
+    JsonWriter writer(_json) ;
+    json(writer) ;
+    writer.finish() ;
+    _jsonVersion = _version ;
+  }
+  return _json ;
+}
+
+const char* Settings::etag() const
+{
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  snprintf(_etag, sizeof(_etag), "\"%08x-%u\"", _boot, _version) ;
+  return _etag ;
+}
+
+uint32_t Settings::version() const
+{
+  return _version ;
+}
 
-    text += "\"" + setting->name() + "\": { " + setting->json() + " }" ;
-  } ;
-  text += " } }" ;
-  
-  return text ;
+uint32_t Settings::since(const char *token) const
+{
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  char *end ;
+  uint32_t boot = strtoul(token, &end, 16) ;
+  if ((end == token) || (*end != '-') || (boot != _boot))
+    return 0 ;
+  const char *v = end + 1 ;
+  uint32_t since = strtoul(v, &end, 10) ;
+  if ((end == v) || *end || (since > _version))
+    return 0 ;
+  return since ;
 }
 
 bool Settings::set(const std::string &key, const std::string &val)
 {
-  auto iSetting = _settingByName.find(key) ;
-  if (iSetting == _settingByName.end())
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  int16_t v ;
+  int i = find(key.c_str()) ;
+  if ((i < 0) || !parse(i, val.data(), val.size(), v))
     return false ;
 
-  return iSetting->second->set(*this, val) ;
+  set(i, val.data(), val.size(), v) ;
+  return true ;
 }
 
-bool Settings::get(const std::string &key, std::string &val)
+bool Settings::set(const Pairs &pairs)
 {
-  auto iSetting = _settingByName.find(key) ;
-  if (iSetting == _settingByName.end())
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  // validate everything before the first setter runs
+  std::vector<std::pair<uint8_t, int16_t>> parsed ;
+  parsed.reserve(pairs.size()) ;
+  for (const auto &pair : pairs)
+  {
+    int16_t v ;
+    int i = find(pair.first.c_str()) ;
+    if ((i < 0) || !parse(i, pair.second.data(), pair.second.size(), v))
+    {
+      ESP_LOGW("Settings", "invalid %s=%s", pair.first.c_str(), pair.second.c_str()) ;
+      return false ;
+    }
+    parsed.emplace_back(i, v) ;
+  }
+
+  for (size_t p = 0 ; p < pairs.size() ; ++p)
+    set(parsed[p].first, pairs[p].second.data(), pairs[p].second.size(), parsed[p].second) ;
+  return true ;
+}
+
+bool Settings::get(const std::string &key, std::string &val) const
+{
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  int i = find(key.c_str()) ;
+  if (i < 0)
     return false ;
 
-  val = iSetting->second->value() ;
+  val = value(i) ;
+  return true ;
+}
+
+bool Settings::get(Pairs &pairs) const
+{
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  for (auto &pair : pairs)
+  {
+    if (!get(pair.first, pair.second))
+      return false ;
+  }
   return true ;
 }
 
+int Settings::find(const char *key, size_t size) const
+{
+  auto cmp = [](const char *defKey, const char *key, size_t size)
+    {
+      int res = strncmp(defKey, key, size) ;
+      return res ? res : (defKey[size] ? 1 : 0) ;
+    } ;
+  const uint8_t *end = _byKey + _size ;
+  const uint8_t *i = std::lower_bound(_byKey, end, key,
+                                      [&](uint8_t i, const char *key) { return cmp(_defs[i]._key, key, size) < 0 ; }) ;
+  return ((i != end) && !cmp(_defs[*i]._key, key, size)) ? *i : -1 ;
+}
+
+bool Settings::parse(uint8_t i, const char *val, size_t size, int16_t &v) const
+{
+  const SettingDef &def = _defs[i] ;
+  switch (def._type)
+  {
+  case SettingDef::Type::Str:
+    return true ;
+  case SettingDef::Type::Int:
+    {
+      const char *e = val + size ;
+      bool neg = (val < e) && (*val == '-') ;
+      if ((val < e) && ((*val == '-') || (*val == '+')))
+        ++val ;
+      if ((val == e) || ((e - val) > 5))
+        return false ;
+      int32_t i{0} ;
+      for ( ; val < e ; ++val)
+      {
+        if ((*val < '0') || ('9' < *val))
+          return false ;
+        i = i*10 + *val - '0' ;
+      }
+      if (neg)
+        i = -i ;
+      if ((i < def._min) || (def._max < i))
+        return false ;
+      v = i ;
+      return true ;
+    }
+  case SettingDef::Type::Enum:
+    for (uint8_t e = 0 ; e < def._enumSize ; ++e)
+    {
+      if ((strlen(def._enums[e]) == size) && !memcmp(def._enums[e], val, size))
+      {
+        v = e ;
+        return true ;
+      }
+    }
+    return false ;
+  }
+  return false ;
+}
+
+void Settings::set(uint8_t i, const char *val, size_t size, int16_t v)
+{
+  const SettingDef &def = _defs[i] ;
+  SettingValue &value = _values[i] ;
+  if (def._type == SettingDef::Type::Str)
+    value._str.assign(val, size) ;
+  else
+    value._int = v ;
+  if (def._setFn)
+    def._setFn(value._int) ;
+  value._version = ++_version ;
+}
+
+std::string Settings::value(uint8_t i) const
+{
+  const SettingDef &def = _defs[i] ;
+  const SettingValue &value = _values[i] ;
+  switch (def._type)
+  {
+  case SettingDef::Type::Str:
+    return value._str ;
+  case SettingDef::Type::Int:
+    return to_s(value._int) ;
+  case SettingDef::Type::Enum:
+    return ((value._int >= 0) && (value._int < def._enumSize)) ? def._enums[value._int] : "" ;
+  }
+  return "" ;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // PublicSettings
 ////////////////////////////////////////////////////////////////////////////////
 
+namespace
+{
+  constexpr const char *offOn[] = { "off", "on" } ;
+  constexpr const char *cores[] = { "0", "1", "any" } ;
+  constexpr const char *framesizes[] =
+    {
+     "96X96",           // 0
+     "QQVGA-160x120",   // 1
+     "QCIF-176x144",    // 2
+     "HQVGA-240x176",   // 3
+     "240x240",         // 4
+     "QVGA-320x240",    // 5
+     "CIF-400x296",     // 6
+     "HVGA-480x320",    // 7
+     "VGA-640x480",     // 8
+     "SVGA-800x600",    // 9
+     "XGA-1024x768",    // 10
+     "HD-1280x720",     // 11
+     "SXGA-1280x1024",  // 12
+     "UXGA-1600x1200",  // 13
+    } ;
+  constexpr const char *flashModes[] = { "off", "caputre", "on" } ;
+
+  int16_t iniOn()             { return 1 ; }
+  int16_t iniStreamWorkers()  { return 2 ; }
+  int16_t iniStreamCore()     { return 1 ; }
+  int16_t iniEventsInterval() { return 1000 ; }
+  void    setEventsInterval(int16_t value) { events.interval(value) ; }
+
+  int16_t iniFramesize()
+  {
+    return camera.sensor().status.framesize ;
+  }
+  void setFramesize(int16_t value)
+  {
+    sensor_t sensor = camera.sensor() ;
+    sensor.set_framesize(&sensor, (framesize_t)value)  ;
+    camera.invalidate() ;
+  }
+
+  int16_t iniFlashMode()
+  {
+    return (int16_t)camera.light().mode() ;
+  }
+  void setFlashMode(int16_t value)
+  {
+    camera.light().mode((Camera::Light::Mode)value) ;
+    camera.invalidate() ;
+  }
+
+  int16_t iniFlashBrightness()
+  {
+    return camera.light().brightness() ;
+  }
+  void setFlashBrightness(int16_t value)
+  {
+    camera.light().brightness(value) ;
+    camera.invalidate() ;
+  }
+
+  int16_t iniQuality()    { return camera.sensor().status.quality ; }
+  int16_t iniBrightness() { return camera.sensor().status.brightness ; }
+  int16_t iniContrast()   { return camera.sensor().status.contrast ; }
+  int16_t iniSaturation() { return camera.sensor().status.saturation ; }
+  int16_t iniSharpness()  { return camera.sensor().status.sharpness ; }
+
+  void setQuality(int16_t value)
+  {
+    sensor_t sensor = camera.sensor() ;
+    sensor.set_quality(&sensor, value) ;
+    camera.invalidate() ;
+  }
+  void setBrightness(int16_t value)
+  {
+    sensor_t sensor = camera.sensor() ;
+    sensor.set_brightness(&sensor, value) ;
+    camera.invalidate() ;
+  }
+  void setContrast(int16_t value)
+  {
+    sensor_t sensor = camera.sensor() ;
+    sensor.set_contrast(&sensor, value) ;
+    camera.invalidate() ;
+  }
+  void setSaturation(int16_t value)
+  {
+    sensor_t sensor = camera.sensor() ;
+    sensor.set_saturation(&sensor, value) ;
+    camera.invalidate() ;
+  }
+  void setSharpness(int16_t value)
+  {
+    sensor_t sensor = camera.sensor() ;
+    sensor.set_sharpness(&sensor, value) ;
+    camera.invalidate() ;
+  }
+
+  // display order, "at boot" settings are read by HTTPD::start()
+  constexpr SettingDef publicDefs[] =
+    {
+     settingStr ("esp.name"               , "ESP32 CAM"),                                      //  0
+     settingEnum("esp.tls-tickets"        , iniOn, nullptr, offOn),                // at boot  //  1
+     settingInt ("esp.stream-workers"     , iniStreamWorkers, nullptr, 1, 4),      // at boot  //  2
+     settingEnum("esp.stream-core"        , iniStreamCore, nullptr, cores),        // at boot  //  3
+     settingInt ("esp.events-interval"    , iniEventsInterval, setEventsInterval, 250,  9999), //  4 [ms]
+     settingEnum("camera.framesize"       , iniFramesize, setFramesize, framesizes),           //  5
+     settingEnum("camera.flash-mode"      , iniFlashMode, setFlashMode, flashModes),           //  6
+     settingInt ("camera.flash-brightness", iniFlashBrightness, setFlashBrightness, 0, 255),   //  7
+     settingInt ("camera.quality"         , iniQuality, setQuality, 0, 63),                    //  8
+     settingInt ("camera.brightness"      , iniBrightness, setBrightness, -2, 2),              //  9
+     settingInt ("camera.contrast"        , iniContrast, setContrast, -2, 2),                  // 10
+     settingInt ("camera.saturation"      , iniSaturation, setSaturation, -2, 2),              // 11
+     settingInt ("camera.sharpness"       , iniSharpness, setSharpness, -2, 2),                // 12
+    } ;
+  constexpr uint8_t publicByKey[countof(publicDefs)] = { 9, 10, 7, 6, 5, 8, 11, 12, 4, 0, 3, 2, 1 } ;
+  static_assert(sorted(publicDefs, publicByKey), "publicByKey is not sorted") ;
+
+  SettingValue publicValues[countof(publicDefs)] ;
+}
+
+PublicSettings publicSettings ;
+
 PublicSettings::PublicSettings() :
-  Settings("settings.txt",
-           std::vector<Setting*>
-           {
-             new SettingStr("esp", "name",
-                            [](Settings &settings) { return "ESP32 CAM" ; },
-                            nullptr),
-               new SettingEnum("camera", "framesize",
-                               [](Settings &settings, const std::vector<std::string> &enums)
-                               {
-                                 size_t framesize = camera.sensor().status.framesize ;
-                                 return (framesize < enums.size()) ? enums[framesize] : "" ;
-                               },
-                               [](Settings &settings, const std::vector<std::string> &enums, const std::string &value)
-                               {
-                                 for (size_t i = 0, e = enums.size() ; i < e ; ++i)
-                                 {
-                                   if (enums[i] == value)
-                                   {
-                                     sensor_t sensor = camera.sensor() ;
-                                     sensor.set_framesize(&sensor, (framesize_t)i)  ;
-                                     return ;
-                                   }
-                                 }
-                               },
-                               {
-                                "96X96",           // 0
-                                "QQVGA-160x120",   // 1
-                                "QCIF-176x144",    // 2
-                                "HQVGA-240x176",   // 3
-                                "240x240",         // 4
-                                "QVGA-320x240",    // 5
-                                "CIF-400x296",     // 6
-                                "HVGA-480x320",    // 7
-                                "VGA-640x480",     // 8
-                                "SVGA-800x600",    // 9
-                                "XGA-1024x768",    // 10
-                                "HD-1280x720",     // 11
-                                "SXGA-1280x1024",  // 12
-                                "UXGA-1600x1200",  // 13
-                               }),
-               new SettingEnum("camera", "flash-mode",
-                               [](Settings &settings, const std::vector<std::string> &enums)
-                               {
-                                 size_t idx = (size_t)(camera.light().mode()) ;
-                                 return (idx < enums.size()) ? enums[idx] : "" ;
-                               },
-                               [](Settings &settings, const std::vector<std::string> &enums, const std::string &value)
-                               {
-                                 for (size_t i = 0, e = enums.size() ; i < e ; ++i)
-                                 {
-                                   if (enums[i] == value)
-                                   {
-                                     camera.light().mode((Camera::Light::Mode)i) ;
-                                     return ;
-                                   }
-                                 }
-                               },
-                               {
-                                "off", "caputre", "on"
-                               }),               
-               new SettingInt("camera", "flash-brightness",
-                              [](Settings &settings) { return camera.light().brightness() ; },
-                              [](Settings &settings, const uint16_t value)
-                              {
-                                camera.light().brightness(value) ;
-                              },
-                              0, 255),
-               new SettingInt("camera", "quality",
-                              [](Settings &settings) { return camera.sensor().status.quality ; },
-                              [](Settings &settings, const int16_t value)
-                              {
-                                sensor_t sensor = camera.sensor() ;
-                                sensor.set_quality(&sensor, value) ;
-                              },
-                              0, 63 ),
-               new SettingInt("camera", "brightness",
-                              [](Settings &settings) { return camera.sensor().status.brightness ; },
-                              [](Settings &settings, const int16_t value)
-                              {
-                                sensor_t sensor = camera.sensor() ;
-                                sensor.set_brightness(&sensor, value) ;
-                              },
-                              -2, 2 ),
-               new SettingInt("camera", "contrast",
-                              [](Settings &settings) { return camera.sensor().status.contrast ; },
-                              [](Settings &settings, const int16_t value)
-                              {
-                                sensor_t sensor = camera.sensor() ;
-                                sensor.set_contrast(&sensor, value) ;
-                              },
-                              -2, 2 ),
-               new SettingInt("camera", "saturation",
-                              [](Settings &settings) { return camera.sensor().status.saturation ; },
-                              [](Settings &settings, const int16_t value)
-                              {
-                                sensor_t sensor = camera.sensor() ;
-                                sensor.set_saturation(&sensor, value) ;
-                              },
-                              -2, 2 ),
-               new SettingInt("camera", "sharpness",
-                              [](Settings &settings) { return camera.sensor().status.sharpness ; },
-                              [](Settings &settings, const int16_t value)
-                              {
-                                sensor_t sensor = camera.sensor() ;
-                                sensor.set_sharpness(&sensor, value) ;
-                              },
-                              -2, 2 ),
-               })
+  Settings("public", "settings.txt", publicDefs, publicByKey, publicValues, countof(publicDefs))
 {
 }
 
@@ -367,29 +640,32 @@ PublicSettings::PublicSettings() :
 // PrivateSettings
 ////////////////////////////////////////////////////////////////////////////////
 
+namespace
+{
+  // display order
+  constexpr SettingDef privateDefs[] =
+    {
+     settingStr("esp.salt"       , "ESP32 CAM"),              // 0
+     settingStr("esp.pwdHash"    , nullptr),                  // 1
+     settingStr("wifi.ap-ssid"   , nullptr),                  // 2
+     settingStr("wifi.ap-country", nullptr),                  // 3
+     settingStr("wifi.st-ssid"   , nullptr),                  // 4
+     settingStr("wifi.st-pwd"    , nullptr),                  // 5
+     settingStr("ota.url"        , nullptr),                  // 6 at boot
+     settingInt("ota.interval"   , nullptr, nullptr, 0, 1440), // 7 at boot [min], 0 on request only
+     settingInt("ota.stage-delay", nullptr, nullptr, 0, 720),  // 8 at boot [h]
+     settingStr("ota.sha256"     , nullptr),                  // 9 hex, of the decoded image
+    } ;
+  constexpr uint8_t privateByKey[countof(privateDefs)] = { 1, 0, 7, 9, 8, 6, 3, 2, 5, 4 } ;
+  static_assert(sorted(privateDefs, privateByKey), "privateByKey is not sorted") ;
+
+  SettingValue privateValues[countof(privateDefs)] ;
+}
+
+PrivateSettings privateSettings ;
+
 PrivateSettings::PrivateSettings() :
-  Settings("secret.txt",
-           std::vector<Setting*>
-           {
-             new SettingStr("esp", "salt",
-                            [](Settings &settings) { return "ESP32 CAM" ; },
-                            nullptr),
-               new SettingStr("esp", "pwdHash",
-                              nullptr,
-                              nullptr),
-               new SettingStr("wifi", "ap-ssid",
-                              nullptr,
-                              nullptr),
-               new SettingStr("wifi", "ap-country",
-                              nullptr,
-                              nullptr),
-               new SettingStr("wifi", "st-ssid",
-                              nullptr,
-                              nullptr),
-               new SettingStr("wifi", "st-pwd",
-                              nullptr,
-                              nullptr),
-               })
+  Settings("private", "secret.txt", privateDefs, privateByKey, privateValues, countof(privateDefs))
 {
 }
 
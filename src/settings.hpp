@@ -6,81 +6,47 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
-class Settings ;
+class JsonWriter ;
 
-class Setting
+struct SettingDef // one row of a constexpr settings table, stays in flash
 {
-public:
-  Setting(const std::string &category, const std::string &name) ;
-  virtual ~Setting() ;
-  
-  const std::string& category() const ;
-  const std::string& name() const ;
-  const std::string& value() const ;
-
-  virtual void init(Settings &settings) = 0 ;
-  virtual bool set(Settings &settings, const std::string &value) = 0 ;
-  virtual std::string json() = 0 ;
-protected:
-  const std::string _category ;
-  const std::string _name ;
-  std::string _value ;
+  enum class Type : uint8_t { Str, Int, Enum } ;
+
+  using IniFn = int16_t (*)() ;             // int value or enum index
+  using SetFn = void (*)(int16_t value) ;   // int value or enum index
+
+  const char *_key ;            // "category.name"
+  Type        _type ;
+  const char *_default ;        // str
+  IniFn       _iniFn ;          // int, enum
+  SetFn       _setFn ;          // int, enum
+  int16_t     _min ;            // int
+  int16_t     _max ;            // int
+  const char *const *_enums ;   // enum
+  uint8_t     _enumSize ;       // enum
 } ;
 
-////////////////////////////////////////////////////////////////////////////////
-
-class SettingStr : public Setting
+constexpr SettingDef settingStr(const char *key, const char *def)
 {
-public:
-  using IniFn = std::function<std::string(Settings &settings)> ;
-  using SetFn = std::function<void(Settings &settings, const std::string &value)> ;
-
-  SettingStr(const std::string &category, const std::string &name, IniFn iniFn, SetFn setFn) ;
-  virtual void init(Settings &settings) ;
-  virtual bool set(Settings &settings, const std::string &value) ;
-  virtual std::string json() ;
-private:
-  IniFn _iniFn ;
-  SetFn _setFn ;
-} ;
-
-////////////////////////////////////////////////////////////////////////////////
+  return { key, SettingDef::Type::Str, def, nullptr, nullptr, 0, 0, nullptr, 0 } ;
+}
 
-class SettingInt : public Setting
+constexpr SettingDef settingInt(const char *key, SettingDef::IniFn iniFn, SettingDef::SetFn setFn, int16_t min, int16_t max)
 {
-public:
-  using IniFn = std::function<int16_t(Settings &settings)> ;
-  using SetFn = std::function<void(Settings &settings, const int16_t value)> ;
-
-  SettingInt(const std::string &category, const std::string &name, IniFn iniFn, SetFn setFn, int16_t min, int16_t max) ;
-  virtual void init(Settings &settings) ;
-  virtual bool set(Settings &settings, const std::string &value) ;
-  virtual std::string json() ;
-private:
-  bool inRange(int16_t &i) const ;
-  
-  IniFn _iniFn ;
-  SetFn _setFn ;
-  int16_t _min ;
-  int16_t _max ;
-} ;
+  return { key, SettingDef::Type::Int, nullptr, iniFn, setFn, min, max, nullptr, 0 } ;
+}
 
-////////////////////////////////////////////////////////////////////////////////
+template<size_t N>
+constexpr SettingDef settingEnum(const char *key, SettingDef::IniFn iniFn, SettingDef::SetFn setFn, const char *const (&enums)[N])
+{
+  return { key, SettingDef::Type::Enum, nullptr, iniFn, setFn, 0, 0, enums, N } ;
+}
 
-class SettingEnum : public Setting
+struct SettingValue // runtime state of one SettingDef
 {
-public:
-  using IniFn = std::function<std::string(Settings &settings, const std::vector<std::string> &enums)> ;
-  using SetFn = std::function<void(Settings &settings, const std::vector<std::string> &enums, const std::string &value)> ;
-  
-  SettingEnum(const std::string &category, const std::string &name, IniFn iniFn, SetFn setFn, const std::vector<std::string>& enums) ;
-  virtual void init(Settings &settings) ;
-  virtual bool set(Settings &settings, const std::string &value) ;
-  virtual std::string json() ;
-private:
-  IniFn _iniFn ;
-  SetFn _setFn ;
-  std::vector<std::string> _enum ;
+  std::string _str ;          // str
+  int16_t     _int{0} ;       // int, enum index (-1 unknown)
+  uint32_t    _version{0} ;   // Settings::version() of the last change
 } ;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -88,24 +54,65 @@ private:
 class Settings
 {
 public:
-  Settings(const std::string &fileName, const std::vector<Setting*> &settings) ;
+  using Pairs = std::vector<std::pair<std::string, std::string>> ;
+
+  // defs in display order, byKey indexes them sorted by key
+  // stored in nvs under nvsKey, fileName on spiffs is imported (and removed) at boot
+  Settings(const char *nvsKey, const char *fileName, const SettingDef *defs, const uint8_t *byKey, SettingValue *values, uint8_t size) ;
   virtual ~Settings() ;
-  
+
   virtual bool init() ;
   virtual bool terminate() ;
 
-  bool load() ;
-  bool save() const ;
-  
-  std::string json() const ;
+  bool load() ;       // nvs, then the import file
+  bool save() const ; // nvs, the previous record stays valid until the commit
+
+  void json(JsonWriter &json, uint32_t since = 0) const ; // settings changed after version since
+  const std::string& json() const ;                      // cached until the version changes
+  const char* etag() const ;
+  uint32_t version() const ;
+  uint32_t since(const char *token) const ; // "<boot>-<version>" as in the etag, 0 if from another boot
+
   bool set(const std::string &key, const std::string &val) ;
-  bool get(const std::string &key, std::string &val) ;
+  bool set(const Pairs &pairs) ; // all or nothing, applied in the given order
+  bool get(const std::string &key, std::string &val) const ;
+  bool get(Pairs &pairs) const ; // fills in the values of the given keys, all read at once
 
 protected:
-  const std::string _fileName ;
-  
-  std::vector<Setting*> _settings ;
-  std::map<std::string, Setting*> _settingByName ;
+  struct Header // nvs record, followed by size bytes of key length, key, value length, value
+  {
+    uint32_t _magic ;
+    uint8_t  _format ;
+    uint8_t  _count ;
+    uint16_t _size ;
+    uint32_t _crc ;   // esp_crc32_le() of the records
+  } ;
+  static constexpr uint32_t _magic{0x53435345} ; // "ESCS"
+  static constexpr uint8_t  _format{1} ;
+  static constexpr size_t   _recordMax{1024} ;
+
+  bool loadNvs() ;
+  bool loadText() ;
+
+  int find(const char *key, size_t size) const ; // index into the defs, -1 if unknown
+  int find(const char *key) const { return find(key, strlen(key)) ; }
+  bool parse(uint8_t i, const char *val, size_t size, int16_t &v) const ; // validates, v for int and enum
+  void set(uint8_t i, const char *val, size_t size, int16_t v) ;
+  std::string value(uint8_t i) const ;
+
+  const char         *_nvsKey ;
+  const char         *_fileName ;
+  const SettingDef   *_defs ;
+  const uint8_t      *_byKey ;
+  SettingValue       *_values ;
+  const uint8_t       _size ;
+  uint32_t _version{0} ;       // bumped by every successful set
+  uint32_t _boot{0} ;          // versions restart on reboot, keeps the etags apart
+
+  mutable std::recursive_mutex _mutex ; // set and read by the httpd, capture and ota tasks
+  mutable std::string _json ;
+  mutable uint32_t    _jsonVersion{0} ;
+  mutable char        _etag[24] ;
 } ;
 
 class PublicSettings : public Settings
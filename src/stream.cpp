@@ -0,0 +1,475 @@
+////////////////////////////////////////////////////////////////////////////////
+// stream.cpp
+////////////////////////////////////////////////////////////////////////////////
+
+#include "esp32-cam.hpp"
+
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <errno.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+StreamPool streamPool ;
+
+constexpr size_t StreamWriter::_capacity ;
+
+////////////////////////////////////////////////////////////////////////////////
+
+FrameRate::FrameRate(uint8_t fps) : _target{1000000 / fps}
+{
+}
+
+void FrameRate::fps(uint8_t fps)
+{
+  _target = 1000000 / fps ;
+}
+
+void FrameRate::begin()
+{
+  _begin = esp_timer_get_time() ;
+}
+
+void FrameRate::end()
+{
+  int64_t send = esp_timer_get_time() - _begin ;
+  _send = _send ? (3 * _send + send) / 4 : send ;
+}
+
+TickType_t FrameRate::delay() const
+{
+  // keep 25% headroom above the send time so the socket can drain
+  int64_t interval = std::max(_target, _send * 5 / 4) ;
+  int64_t elapsed = esp_timer_get_time() - _begin ;
+  if (elapsed >= interval)
+    return 0 ;
+  return (interval - elapsed) / 1000 / portTICK_PERIOD_MS ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+StreamWriter::StreamWriter(StreamSession &session) :
+  _session(session), _buff{(uint8_t*) malloc(_capacity)}
+{
+}
+
+StreamWriter::~StreamWriter()
+{
+  if (_buff)
+    free(_buff) ;
+}
+
+bool StreamWriter::write(const void *data, size_t size)
+{
+  if (!_buff)
+    return false ;
+
+  const uint8_t *d = (const uint8_t*) data ;
+  if ((_size + size) < _capacity)
+  {
+    memcpy(_buff + _size, d, size) ;
+    _size += size ;
+    return true ;
+  }
+
+  // top up the buffer to one full record
+  size_t n = _capacity - _size ;
+  memcpy(_buff + _size, d, n) ;
+  d += n ;
+  size -= n ;
+  _size = 0 ;
+  if (!send(_buff, _capacity))
+    return false ;
+
+  // full records straight from the source, keep the tail
+  n = size - (size % _capacity) ;
+  if (n && !send(d, n))
+    return false ;
+  d += n ;
+  size -= n ;
+
+  memcpy(_buff, d, size) ;
+  _size = size ;
+  return true ;
+}
+
+bool StreamWriter::flush()
+{
+  if (!_size)
+    return true ;
+
+  size_t size = _size ;
+  _size = 0 ;
+  return send(_buff, size) ;
+}
+
+bool StreamWriter::send(const uint8_t *data, size_t size)
+{
+  // one record per lock, the httpd task may read the socket in between
+  while (size)
+  {
+    size_t n = std::min(size, _capacity) ;
+    if (!_session.send(data, n))
+      return false ;
+    data += n ;
+    size -= n ;
+  }
+  return true ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+StreamSession::StreamSession(httpd_req_t *req) :
+  _hd{req->handle}, _sockfd{httpd_req_to_sockfd(req)}
+{
+}
+
+StreamSession::~StreamSession()
+{
+}
+
+bool StreamSession::open() const
+{
+  return _open ;
+}
+
+void StreamSession::attach(httpd_req_t *req)
+{
+  // httpd tells the session when the socket is closed
+  req->sess_ctx = this ;
+  req->free_ctx = StreamSession::closed ;
+
+  // the httpd task still reads the socket (websocket control, close) and answers pings,
+  // it takes the session lock for that from now on
+  httpd_sess_set_send_override(_hd, _sockfd, sendFn) ;
+  httpd_sess_set_recv_override(_hd, _sockfd, recvFn) ;
+
+  struct timeval timeout{_sendTimeout, 0} ;
+  setsockopt(_sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) ;
+}
+
+bool StreamSession::send(const void *data, size_t size)
+{
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  const char *d = (const char*) data ;
+  while (_open && size)
+  {
+    int n = httpd_socket_send(_hd, _sockfd, d, size, 0) ;
+    if (n <= 0)
+    {
+      ESP_LOGD("Stream", "httpd_socket_send() failed %d", n) ;
+      return false ;
+    }
+    d += n ;
+    size -= n ;
+  }
+  return _open ;
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+bool StreamSession::send(httpd_ws_frame_t &frame)
+{
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  if (!_open)
+    return false ;
+  esp_err_t err = httpd_ws_send_frame_async(_hd, _sockfd, &frame) ;
+  if (err != ESP_OK)
+  {
+    ESP_LOGD("Stream", "httpd_ws_send_frame_async() failed %d", err) ;
+    return false ;
+  }
+  return true ;
+}
+#endif
+
+bool StreamSession::writable()
+{
+  std::lock_guard<std::recursive_mutex> lock(_mutex) ;
+  if (!_open)
+    return false ;
+  fd_set fds ;
+  FD_ZERO(&fds) ;
+  FD_SET(_sockfd, &fds) ;
+  struct timeval timeout{0, 0} ;
+  return select(_sockfd + 1, nullptr, &fds, nullptr, &timeout) > 0 ;
+}
+
+int StreamSession::sendFn(httpd_handle_t hd, int sockfd, const char *buf, size_t size, int flags)
+{
+  StreamSession *session = (StreamSession*) httpd_sess_get_ctx(hd, sockfd) ;
+  std::lock_guard<std::recursive_mutex> lock(session->_mutex) ;
+  esp_tls_t *tls = (esp_tls_t*) httpd_sess_get_transport_ctx(hd, sockfd) ;
+  if (tls)
+    return esp_tls_conn_write(tls, buf, size) ;
+  int n = ::send(sockfd, buf, size, flags) ;
+  return (n >= 0) ? n : ((errno == EAGAIN) || (errno == EINTR)) ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL ;
+}
+
+int StreamSession::recvFn(httpd_handle_t hd, int sockfd, char *buf, size_t size, int flags)
+{
+  StreamSession *session = (StreamSession*) httpd_sess_get_ctx(hd, sockfd) ;
+  std::lock_guard<std::recursive_mutex> lock(session->_mutex) ;
+  esp_tls_t *tls = (esp_tls_t*) httpd_sess_get_transport_ctx(hd, sockfd) ;
+  if (tls)
+    return esp_tls_conn_read(tls, buf, size) ;
+  int n = ::recv(sockfd, buf, size, flags) ;
+  return (n >= 0) ? n : ((errno == EAGAIN) || (errno == EINTR)) ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL ;
+}
+
+bool StreamSession::owns() const
+{
+  // closed() runs on the httpd task too, so the sockfd can not be reused meanwhile
+  return _open && (httpd_sess_get_ctx(_hd, _sockfd) == this) ;
+}
+
+void StreamSession::touch()
+{
+  // once a second is enough to stay ahead of the idle control connections
+  int64_t now = esp_timer_get_time() ;
+  if (now - _touched < 1000000)
+    return ;
+  _touched = now ;
+  retain() ;
+  if (httpd_queue_work(_hd, touchWork, this) != ESP_OK)
+    release() ;
+}
+
+void StreamSession::touchWork(void *arg)
+{
+  StreamSession *session = (StreamSession*) arg ;
+  if (session->owns())
+    httpd_sess_update_lru_counter(session->_hd, session->_sockfd) ;
+  session->release() ;
+}
+
+void StreamSession::close()
+{
+  retain() ;
+  if (httpd_queue_work(_hd, closeWork, this) != ESP_OK)
+    release() ;
+}
+
+void StreamSession::closeWork(void *arg)
+{
+  StreamSession *session = (StreamSession*) arg ;
+  if (session->owns())
+    httpd_sess_trigger_close(session->_hd, session->_sockfd) ;
+  session->release() ;
+}
+
+void StreamSession::retain()
+{
+  ++_refs ;
+}
+
+void StreamSession::release()
+{
+  if (--_refs == 0)
+    delete this ;
+}
+
+void StreamSession::closed(void *ctx)
+{
+  // httpd frees the tls context next, a send in progress has to end first
+  StreamSession *session = (StreamSession*) ctx ;
+  {
+    std::lock_guard<std::recursive_mutex> lock(session->_mutex) ;
+    session->_open = false ;
+  }
+  session->release() ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+MjpegSession::MjpegSession(httpd_req_t *req, uint8_t fps) :
+  StreamSession(req), _fps{fps}
+{
+}
+
+void MjpegSession::run()
+{
+  static const char head[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=esp32camstreampart\r\n"
+    "Cache-Control: no-store\r\n"
+    "\r\n"
+    "--esp32camstreampart\r\n" ;
+  static const char boundary[] = "\r\n--esp32camstreampart\r\n" ;
+
+  FrameRate frameRate(_fps) ;
+
+  // no chunked encoding, the multipart response ends when the connection closes
+  StreamWriter writer(*this) ;
+  if (!writer.write(head, sizeof(head)-1) || !writer.flush())
+    return ;
+
+  Camera::Stream stream(camera) ;
+  while (open()) // send images
+  {
+    Frame frame ;
+    if (!stream.next(frame))
+    {
+      ESP_LOGE("Camera", "capture failed") ;
+      return ;
+    }
+
+    char part[64] ;
+    int partSize = snprintf(part, sizeof(part), "Content-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", frame->len) ;
+
+    frameRate.begin() ;
+    if (!open() ||
+        !writer.write(part, partSize) ||
+        !writer.write(frame->buf, frame->len) ||
+        !writer.write(boundary, sizeof(boundary)-1) ||
+        !writer.flush())
+      return ;
+    frameRate.end() ;
+    stream.sent(partSize + frame->len + sizeof(boundary)-1) ;
+    touch() ;
+
+    frame.reset() ; // hand the buffer back to the driver while waiting
+    vTaskDelay(frameRate.delay()) ;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+
+WsSession::WsSession(httpd_req_t *req) :
+  StreamSession(req)
+{
+}
+
+bool WsSession::control(const std::string &key, const std::string &value)
+{
+  if (key == "fps")
+  {
+    int16_t fps ;
+    if (!to_i(value, fps) || (fps < 1) || (30 < fps))
+      return false ;
+    _fps = fps ;
+    return true ;
+  }
+  if (key == "pause")
+  {
+    _paused = value == "1" ;
+    return true ;
+  }
+
+  // camera settings, "framesize" or "camera.framesize"
+  bool result ;
+  std::string k = (key.find('.') == std::string::npos) ? "camera." + key : key ;
+  return camera.apply([&k, &value]{ return publicSettings.set(k, value) ; }, result) && result ;
+}
+
+void WsSession::run()
+{
+  FrameRate frameRate(_fps) ;
+  std::unique_ptr<Camera::Stream> stream ;
+
+  while (open())
+  {
+    if (_paused)
+    {
+      stream.reset() ; // let the capture task idle
+      vTaskDelay(100 / portTICK_PERIOD_MS) ;
+      continue ;
+    }
+    if (!stream)
+      stream.reset(new Camera::Stream(camera)) ;
+
+    Frame frame ;
+    if (!stream->next(frame))
+    {
+      ESP_LOGE("Camera", "capture failed") ;
+      return ;
+    }
+
+    // one fragment per lock, the control frames are read in between
+    static const size_t fragment = 4096 ;
+    frameRate.fps(_fps) ;
+    frameRate.begin() ;
+    for (size_t pos = 0 ; pos < frame->len ; pos += fragment)
+    {
+      httpd_ws_frame_t pkt = {} ;
+      pkt.type = pos ? HTTPD_WS_TYPE_CONTINUE : HTTPD_WS_TYPE_BINARY ;
+      pkt.fragmented = frame->len > fragment ;
+      pkt.final = pos + fragment >= frame->len ;
+      pkt.payload = frame->buf + pos ;
+      pkt.len = std::min(fragment, frame->len - pos) ;
+      if (!open() || !send(pkt))
+        return ;
+    }
+    frameRate.end() ;
+    stream->sent(frame->len) ;
+    touch() ;
+
+    frame.reset() ;
+    vTaskDelay(frameRate.delay()) ;
+  }
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool StreamPool::init(uint8_t size, BaseType_t core)
+{
+  if (_queue)
+    return true ;
+
+  _queue = xQueueCreate(size, sizeof(StreamSession*)) ;
+  if (!_queue)
+  {
+    ESP_LOGE("Stream", "xQueueCreate() failed") ;
+    return false ;
+  }
+
+  for (uint8_t i = 0 ; i < size ; ++i)
+  {
+    if (xTaskCreatePinnedToCore(worker, "Stream", 6144, this, 5, nullptr, core) != pdPASS)
+    {
+      ESP_LOGE("Stream", "xTaskCreatePinnedToCore() failed") ;
+      return false ;
+    }
+  }
+  return true ;
+}
+
+bool StreamPool::start(httpd_req_t *req, StreamSession *session)
+{
+  uint8_t idle = _idle ;
+  do
+  {
+    if (!_queue || !idle)
+    {
+      delete session ;
+      return false ;
+    }
+  } while (!_idle.compare_exchange_weak(idle, idle - 1)) ;
+
+  session->attach(req) ;
+  xQueueSend(_queue, &session, portMAX_DELAY) ;
+  return true ;
+}
+
+void StreamPool::worker(void *arg)
+{
+  StreamPool &pool = *(StreamPool*) arg ;
+  while (true)
+  {
+    StreamSession *session ;
+    ++pool._idle ;
+    xQueueReceive(pool._queue, &session, portMAX_DELAY) ;
+
+    session->run() ;
+
+    session->close() ;
+    session->release() ;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// EOF
+////////////////////////////////////////////////////////////////////////////////
@@ -67,35 +67,29 @@ esp_err_t wifiSetup(httpd_req_t *req)
 
   httpd_resp_set_type(req, "text/plain") ;
 
+  MultiPart::Fields fields ;
   MultiPart multiPart(req) ;
-  if (!multiPart.parse())
+  if (!multiPart.parse(fields, 64))
     return ESP_OK ;
 
-  MultiPart::Part wifiSsid ;
-  MultiPart::Part wifiPwd ;
-  MultiPart::Part espPwd ;
-  if (!multiPart.get("wifi-ssid", wifiSsid))
+  auto wifiSsid = fields.find("wifi-ssid") ;
+  auto wifiPwd  = fields.find("wifi-pwd") ;
+  auto espPwd   = fields.find("esp-pwd") ;
+  if (wifiSsid == fields.end())
     return httpd_resp_sendstr(req, "Content-Disposition: form-data; name=\"wifi-ssid\" not found") ;
 
-  if (!multiPart.get("wifi-pwd", wifiPwd))
+  if (wifiPwd == fields.end())
     return httpd_resp_sendstr(req, "Content-Disposition: form-data; name=\"wifi-pwd\" not found") ;
-  if (!multiPart.get("esp-pwd", espPwd))
+  if (espPwd == fields.end())
     return httpd_resp_sendstr(req, "Content-Disposition: form-data; name=\"esp-pwd\" not found") ;
 
-  if (wifiSsid.bodySize() > 64)
-    return httpd_resp_sendstr(req, "wifi ssid too big") ;
-  if (wifiPwd.bodySize() > 64)
-    return httpd_resp_sendstr(req, "wifi pwd too big") ;
-  if (espPwd.bodySize() > 64)
-    return httpd_resp_sendstr(req, "esp pwd too big") ;
-  
-  if (!crypto.pwdCheck(std::vector<uint8_t>(espPwd._bodyBegin, espPwd._bodyEnd)))
+  if (!crypto.pwdCheck(std::vector<uint8_t>(espPwd->second.begin(), espPwd->second.end())))
     return httpd_resp_sendstr(req, "invalid password") ;
 
   ////////////////////////////////////////
 
-  std::string ssid((const char*)wifiSsid._bodyBegin, wifiSsid.bodySize()) ;
-  std::string pwd ((const char*)wifiPwd ._bodyBegin, wifiPwd .bodySize()) ;
+  const std::string &ssid = wifiSsid->second ;
+  const std::string &pwd  = wifiPwd ->second ;
 
   privateSettings.set("wifi.st-ssid", ssid) ;
   privateSettings.set("wifi.st-pwd", pwd) ;
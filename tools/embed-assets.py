@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+################################################################################
+# embed-assets.py
+#
+# generates a C++ source with the web ui files as constexpr tables, each with
+# a precompressed gzip variant if that is smaller
+#
+# usage: embed-assets.py <output.cpp> <file> ...
+################################################################################
+
+import gzip
+import os
+import sys
+
+################################################################################
+
+def fnv1a(data):
+    h = 0xcbf29ce484222325
+    for b in data:
+        h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+def array(name, data):
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append('  ' + ', '.join('0x%02x' % b for b in data[i:i+16]) + ',')
+    return 'static constexpr uint8_t %s[] =\n{\n%s\n} ;\n' % (name, '\n'.join(lines))
+
+def main(out, files):
+    arrays = []
+    entries = []
+    for i, path in enumerate(sorted(files)):
+        with open(path, 'rb') as f:
+            raw = f.read()
+        gz = gzip.compress(raw, compresslevel=9, mtime=0)
+        etag = '%016x' % fnv1a(raw)
+
+        arrays.append(array('asset%d' % i, raw))
+        if len(gz) < len(raw):
+            arrays.append(array('asset%dGz' % i, gz))
+            gzName, gzSize = 'asset%dGz' % i, 'sizeof(asset%dGz)' % i
+        else:
+            gzName, gzSize = 'nullptr', '0'
+
+        entries.append('  { "%s", asset%d, sizeof(asset%d), %s, %s, "\\"%s\\"", "\\"%s-gz\\"" },'
+                       % (os.path.basename(path), i, i, gzName, gzSize, etag, etag))
+
+    text = []
+    text.append('/' * 80)
+    text.append('// assets.cpp -- generated by tools/embed-assets.py, do not edit')
+    text.append('/' * 80)
+    text.append('')
+    text.append('#include "esp32-cam.hpp"')
+    text.append('')
+    text.append('/' * 80)
+    text.append('')
+    text.extend(arrays)
+    text.append('constexpr Asset assets[]')
+    text.append('{')
+    text.extend(entries)
+    text.append('  { nullptr, nullptr, 0, nullptr, 0, nullptr, nullptr }')
+    text.append('} ;')
+    text.append('')
+    text.append('/' * 80)
+    text.append('// EOF')
+    text.append('/' * 80)
+    text = '\n'.join(text) + '\n'
+
+    # keep the timestamp if nothing changed
+    if os.path.exists(out):
+        with open(out) as f:
+            if f.read() == text:
+                return
+    with open(out, 'w') as f:
+        f.write(text)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        sys.exit('usage: embed-assets.py <output.cpp> <file> ...')
+    main(sys.argv[1], sys.argv[2:])
+
+################################################################################
+# EOF
+################################################################################
@@ -0,0 +1,144 @@
+////////////////////////////////////////////////////////////////////////////////
+// memmem-bench.cpp
+//
+// host benchmark of the MultiPart boundary search against the previous naive
+// first byte scan, on a firmware like multipart body searched in 4k chunks
+// the way MultiPart::parse() does
+//
+// build: g++ -O2 -std=gnu++11 -o memmem-bench tools/memmem-bench.cpp
+// usage: memmem-bench [firmware.bin]
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../src/memmem.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const uint8_t* naive(const uint8_t *buff, size_t size, const uint8_t *pattern, size_t patternSize)
+{
+  if (!patternSize || !buff || (patternSize > size))
+    return nullptr ;
+  uint8_t first = pattern[0] ;
+  for (const uint8_t *b = buff, *e = buff+size-patternSize ; b <= e ; ++b)
+  {
+    if ((*b == first) &&
+        !memcmp(b, pattern, patternSize))
+      return b ;
+  }
+  return nullptr ;
+}
+
+// code like bytes, zero runs and strings with line breaks
+static std::vector<uint8_t> firmware(size_t size)
+{
+  std::mt19937 rnd(42) ;
+  std::vector<uint8_t> data ;
+  const char *text = "E (%u) %s: esp_camera_fb_get failed\r\nContent-Type: text/plain\r\n" ;
+  while (data.size() < size)
+  {
+    switch (rnd() % 3)
+    {
+    case 0:
+      for (int i = rnd() % 512 ; i ; --i)
+        data.push_back(rnd()) ;
+      break ;
+    case 1:
+      data.insert(data.end(), rnd() % 64, 0) ;
+      break ;
+    default:
+      data.insert(data.end(), text, text + strlen(text)) ;
+      break ;
+    }
+  }
+  data.resize(size) ;
+  return data ;
+}
+
+template<typename Find>
+static double bench(const std::vector<uint8_t> &body, size_t delimiterSize, Find find, size_t &found)
+{
+  const size_t chunk = 4096 ;
+  auto t0 = std::chrono::steady_clock::now() ;
+  for (int run = 0 ; run < 20 ; ++run)
+  {
+    found = 0 ;
+    for (size_t pos = 0 ; pos < body.size() ; )
+    {
+      size_t n = std::min(chunk, body.size() - pos) ;
+      const uint8_t *hit = find(body.data() + pos, n) ;
+      if (hit)
+      {
+        ++found ;
+        pos = hit - body.data() + delimiterSize ;
+      }
+      else
+        pos += (pos + n < body.size()) ? n - (delimiterSize-1) : n ; // keep a split delimiter
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now() ;
+  return std::chrono::duration<double, std::milli>(t1 - t0).count() / 20 ;
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<uint8_t> fw ;
+  if (argc > 1)
+  {
+    std::ifstream file(argv[1], std::ios::binary) ;
+    fw.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()) ;
+  }
+  else
+    fw = firmware(1536 * 1024) ;
+
+  // firefox style boundary
+  const std::string delimiter = "\r\n-----------------------------735323031399963166993862150" ;
+  std::string head = "--" + delimiter.substr(2) + "\r\nContent-Disposition: form-data; name=\"firmware\"; filename=\"firmware.bin\"\r\n"
+    "Content-Type: application/octet-stream\r\n\r\n" ;
+  std::vector<uint8_t> body(head.begin(), head.end()) ;
+  body.insert(body.end(), fw.begin(), fw.end()) ;
+  body.insert(body.end(), delimiter.begin(), delimiter.end()) ;
+  body.insert(body.end(), { '-', '-', '\r', '\n' }) ;
+
+  const uint8_t *pattern = (const uint8_t*) delimiter.data() ;
+  const size_t size = delimiter.size() ;
+  const Horspool horspool(pattern, size) ;
+
+  // same hits at every offset and length, including misaligned buffers
+  std::mt19937 rnd(7) ;
+  for (int i = 0 ; i < 100000 ; ++i)
+  {
+    size_t pos = rnd() % body.size() ;
+    size_t n = std::min<size_t>(rnd() % 8192, body.size() - pos) ;
+    size_t p = 1 + rnd() % 8 ;
+    const uint8_t *b = body.data() + pos ;
+    if ((naive(b, n, pattern, size) != horspool.find(b, n)) ||
+        (naive(b, n, b + n/2, std::min(p, n - n/2)) != memmem(b, n, b + n/2, std::min(p, n - n/2))))
+    {
+      printf("mismatch at %zu size %zu\n", pos, n) ;
+      return 1 ;
+    }
+  }
+
+  size_t found[3] ;
+  double ms[3] ;
+  ms[0] = bench(body, size, [&](const uint8_t *b, size_t n) { return naive(b, n, pattern, size) ; }, found[0]) ;
+  ms[1] = bench(body, size, [&](const uint8_t *b, size_t n) { return memmem(b, n, pattern, size) ; }, found[1]) ;
+  ms[2] = bench(body, size, [&](const uint8_t *b, size_t n) { return horspool.find(b, n) ; }, found[2]) ;
+
+  printf("body %zu bytes, delimiter %zu bytes\n", body.size(), size) ;
+  printf("naive     %8.3f ms  found %zu\n", ms[0], found[0]) ;
+  printf("word      %8.3f ms  found %zu  %.1fx\n", ms[1], found[1], ms[0] / ms[1]) ;
+  printf("horspool  %8.3f ms  found %zu  %.1fx\n", ms[2], found[2], ms[0] / ms[2]) ;
+  return 0 ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// EOF
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+################################################################################
+# ota-image.py
+#
+# builds smaller images for /ota, the device detects the format by itself
+#
+#   compress: zlib of the firmware
+#   delta:    zlib of a delta against the firmware running on the device,
+#             which is checked by its sha256 before anything is written
+#
+# delta format (little endian):
+#   "ESPD" format(u8) reserved(3) oldSize(u32) newSize(u32) sha256(old)
+#   'C' offset(u32) length(u32)   copy from the running firmware
+#   'D' length(u32) data          new data
+#   'E'                           end
+#
+# usage: ota-image.py compress <new.bin> <out>
+#        ota-image.py delta <old.bin> <new.bin> <out>
+################################################################################
+
+import hashlib
+import struct
+import sys
+import zlib
+
+################################################################################
+
+BLOCK = 32   # shortest match that is looked up
+STEP = 16    # old image is indexed every STEP bytes, matches >= BLOCK+STEP-1 are found
+
+def delta(old, new):
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1, STEP):
+        index.setdefault(old[i:i+BLOCK], i)
+
+    ops = [struct.pack('<4sB3xII32s', b'ESPD', 1, len(old), len(new), hashlib.sha256(old).digest())]
+    data = 0 # start of pending new data
+    i = 0
+    while i <= len(new) - BLOCK:
+        j = index.get(new[i:i+BLOCK])
+        if j is None:
+            i += 1
+            continue
+        # extend backwards into the pending data, then forwards
+        while i > data and j > 0 and new[i-1] == old[j-1]:
+            i -= 1
+            j -= 1
+        n = BLOCK
+        while i+n < len(new) and j+n < len(old) and new[i+n] == old[j+n]:
+            n += 1
+        if i > data:
+            ops.append(struct.pack('<cI', b'D', i - data) + new[data:i])
+        ops.append(struct.pack('<cII', b'C', j, n))
+        i += n
+        data = i
+    if len(new) > data:
+        ops.append(struct.pack('<cI', b'D', len(new) - data) + new[data:])
+    ops.append(b'E')
+    return b''.join(ops)
+
+def main(argv):
+    if len(argv) == 4 and argv[1] == 'compress':
+        with open(argv[2], 'rb') as f:
+            new = f.read()
+        out = zlib.compress(new, 9)
+        path = argv[3]
+    elif len(argv) == 5 and argv[1] == 'delta':
+        with open(argv[2], 'rb') as f:
+            old = f.read()
+        with open(argv[3], 'rb') as f:
+            new = f.read()
+        out = zlib.compress(delta(old, new), 9)
+        path = argv[4]
+    else:
+        sys.stderr.write('usage: ota-image.py compress <new.bin> <out>\n'
+                         '       ota-image.py delta <old.bin> <new.bin> <out>\n')
+        return 1
+
+    with open(path, 'wb') as f:
+        f.write(out)
+    print('%s: %d bytes (%.1f%% of %d)' % (path, len(out), 100.0 * len(out) / len(new), len(new)))
+    print('firmware-sha256: %s' % hashlib.sha256(new).hexdigest())
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+################################################################################
+# EOF
+################################################################################